@@ -0,0 +1,179 @@
+/** @file adjacency.h
+ * Definition of classes Adjacency and MutableAdjacency.
+ */
+
+#ifndef ADJACENCY_H
+#define ADJACENCY_H
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "geom.h"
+#include "parallel.h"
+
+using namespace std;
+
+/** False for a corner that repeats an earlier vertex of a degenerate triangle */
+inline bool firstCorner (const Triangle &t, int k)
+{
+    return (k < 1 || t.v[k] != t.v[0]) && (k < 2 || t.v[k] != t.v[1]);
+}
+
+/**
+ * The triangles of each vertex, in compressed sparse rows.
+ *
+ * The triangles of vertex v are mIndices[mOffsets[v], mOffsets[v+1]),
+ * in increasing order. Two flat arrays replace one tree per vertex,
+ * so building and copying it is a few large allocations.
+ */
+class Adjacency
+{
+    vector<int> mOffsets;                       ///< Start of the triangles of each vertex, and the end of the last
+    vector<int> mIndices;                       ///< The triangles of all the vertices, one vertex after the other
+
+public:
+    Adjacency (): mOffsets(1, 0) {}
+
+    /**
+     * Counting sort of the triangle corners by vertex, on all threads.
+     * The corners are counted and placed with atomic counters, then each
+     * vertex sorts its own few triangles, so the result is the same for
+     * any number of threads. Deleted triangles are left out, and a
+     * triangle appears once for each of its distinct vertices.
+     */
+    void build (int vertices, const vector<Triangle> &triangles) {
+        int n = triangles.size();
+        int chunks = std::max(1, std::min(n/4096, 4*Parallel::threadCount()));
+        vector<atomic<int> > cursor(vertices);
+        for (int v=0; v<vertices; ++v)
+            cursor[v] = 0;
+
+        Parallel::run(chunks, [&](int c) {
+            for (int ti=(long long)n*c/chunks; ti<(long long)n*(c+1)/chunks; ++ti)
+                if (!triangles[ti].deleted)
+                    for (int k=0; k<3; ++k)
+                        if (firstCorner(triangles[ti], k))
+                            cursor[triangles[ti].v[k]]++;
+        });
+
+        mOffsets.resize(vertices+1);
+        mOffsets[0] = 0;
+        for (int v=0; v<vertices; ++v) {
+            mOffsets[v+1] = mOffsets[v] + cursor[v];
+            cursor[v] = mOffsets[v];
+        }
+        mIndices.resize(mOffsets[vertices]);
+
+        Parallel::run(chunks, [&](int c) {
+            for (int ti=(long long)n*c/chunks; ti<(long long)n*(c+1)/chunks; ++ti)
+                if (!triangles[ti].deleted)
+                    for (int k=0; k<3; ++k)
+                        if (firstCorner(triangles[ti], k))
+                            mIndices[cursor[triangles[ti].v[k]]++] = ti;
+        });
+
+        Parallel::run(chunks, [&](int c) {
+            for (int v=(long long)vertices*c/chunks; v<(long long)vertices*(c+1)/chunks; ++v)
+                sort(mIndices.begin()+mOffsets[v], mIndices.begin()+mOffsets[v+1]);
+        });
+    }
+
+    const int *begin (int v) const { return mIndices.data() + mOffsets[v]; }
+    const int *end (int v) const { return mIndices.data() + mOffsets[v+1]; }
+    int size (int v) const { return mOffsets[v+1] - mOffsets[v]; }
+    int vertices () const { return mOffsets.size()-1; }
+
+    /** Bytes held by the two arrays */
+    size_t memory () const {
+        return mOffsets.capacity()*sizeof(int) + mIndices.capacity()*sizeof(int);
+    }
+};
+
+/**
+ * The triangles of each vertex, for the edge collapses of simplify.
+ *
+ * Each vertex has a slot of the flat array, with room to grow. The lists
+ * stay sorted. A list that outgrows its slot moves to a slot twice as
+ * large at the end of the array. Pointers from begin() and end() are
+ * only valid until the next merge().
+ */
+class MutableAdjacency
+{
+    vector<int> mData;                          ///< The slots of all the vertices
+    vector<int> mStart;                         ///< Start of the slot of each vertex
+    vector<int> mSize;                          ///< Triangles of each vertex
+    vector<int> mCap;                           ///< Size of the slot of each vertex
+
+public:
+    /** The triangles of the vertices that are not deleted, with room for as many again */
+    MutableAdjacency (int vertices, const vector<Triangle> &triangles):
+        mStart(vertices+1, 0),
+        mSize(vertices, 0),
+        mCap(vertices)
+    {
+        for (int ti=0; ti<triangles.size(); ++ti)
+            if (!triangles[ti].deleted)
+                for (int k=0; k<3; ++k)
+                    if (firstCorner(triangles[ti], k))
+                        ++mSize[triangles[ti].v[k]];
+        for (int v=0; v<vertices; ++v) {
+            mCap[v] = std::max(4, 2*mSize[v]);
+            mStart[v+1] = mStart[v] + mCap[v];
+            mSize[v] = 0;
+        }
+        mData.resize(mStart[vertices]);
+        for (int ti=0; ti<triangles.size(); ++ti)
+            if (!triangles[ti].deleted)
+                for (int k=0; k<3; ++k) {
+                    if (!firstCorner(triangles[ti], k)) continue;
+                    int v = triangles[ti].v[k];
+                    mData[mStart[v] + mSize[v]++] = ti;
+                }
+    }
+
+    const int *begin (int v) const { return mData.data() + mStart[v]; }
+    const int *end (int v) const { return mData.data() + mStart[v] + mSize[v]; }
+    int size (int v) const { return mSize[v]; }
+    bool empty (int v) const { return !mSize[v]; }
+
+    /** Removes a triangle from the list of a vertex, if it is there */
+    void erase (int v, int t) {
+        int *b = mData.data() + mStart[v], *e = b + mSize[v];
+        int *i = lower_bound(b, e, t);
+        if (i == e || *i != t) return;
+        copy(i+1, e, i);
+        --mSize[v];
+    }
+
+    /** Moves the triangles of vertex from to vertex v. The list of from is left empty. */
+    void merge (int v, int from) {
+        if (from == v) return;
+        int need = mSize[v] + mSize[from];
+        if (need > mCap[v]) {
+            int start = mData.size();
+            mData.resize(start + 2*need);
+            copy(begin(v), end(v), mData.begin()+start);
+            mStart[v] = start;
+            mCap[v] = 2*need;
+        }
+
+        /* Merge from the back, so that the list of v is merged in place */
+        int *d = mData.data();
+        int i = mStart[v] + mSize[v] - 1, j = mStart[from] + mSize[from] - 1;
+        int out = mStart[v] + need - 1;
+        while (j >= mStart[from]) {
+            if (i >= mStart[v] && d[i] > d[j]) d[out--] = d[i--];
+            else d[out--] = d[j--];
+        }
+        mSize[v] = need;
+        mSize[from] = 0;
+
+        /* A triangle of both vertices is now in twice */
+        int *b = d + mStart[v];
+        mSize[v] = unique(b, b + need) - b;
+    }
+
+    void clear (int v) { mSize[v] = 0; }
+};
+
+#endif
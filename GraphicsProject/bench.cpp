@@ -0,0 +1,943 @@
+/** @file bench.cpp
+ * Implementation of class Bench.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include "bench.h"
+#include "geom.h"
+#include "mesh.h"
+#include "parallel.h"
+
+using namespace std;
+
+/**
+ * Random float in [lo, hi]. Uses rand() so that runs are repeatable.
+ */
+static float frand(float lo, float hi)
+{
+    return lo + (hi-lo)*rand()/RAND_MAX;
+}
+
+static Point prand(float lo, float hi)
+{
+    return Point(frand(lo, hi), frand(lo, hi), frand(lo, hi));
+}
+
+/**
+ * The ray-triangle test as it was before the Moller-Trumbore kernel.
+ * Kept as the reference for speed and results.
+ */
+static bool legacyIntersects(const Triangle &t, const Line &l)
+{
+    if (t.planeEquation(l.start) * t.planeEquation(l.end) > 0)
+        return false;
+
+    Point dl = Point(l.end).sub(l.start);
+    float tdl = -t.planeEquation(l.start)/(t.planeEquation(dl)- t.D);
+    Point i = Point(l.start).add(dl.scale(tdl));
+
+    Point N(t.getNormal());
+    vector<Point> tempVec(6);
+    tempVec[0] = tempVec[3] = t.v1();
+    tempVec[1] = tempVec[4] = t.v2();
+    tempVec[2] = tempVec[5] = t.v3();
+    tempVec[3].add(N);
+    tempVec[4].add(N);
+    tempVec[5].add(N);
+    float eq1 = Triangle(&tempVec, 0, 1, 3).planeEquation(i);
+    float eq2 = Triangle(&tempVec, 1, 2, 4).planeEquation(i);
+    float eq3 = Triangle(&tempVec, 2, 3, 5).planeEquation(i);
+
+    return (eq1>0 && eq2>0 && eq3>0) || (eq1<0 && eq2<0 && eq3<0);
+}
+
+static void report(const char *name, double secs, double tests, long hits, long mismatches)
+{
+    printf("  %-24s %8.2f Mtests/s | %ld hits | %ld differ from legacy \n",
+           name, tests/secs/1e6, hits, mismatches);
+}
+
+void Bench::rayTriangle()
+{
+    const int NT = 4096, NL = 512;
+    srand(1);
+
+    vector<Point> vertices;
+    vector<Triangle> triangles;
+    vector<Line> lines;
+    for (int i=0; i<NT; ++i) {
+        Point c = prand(-1, 1);
+        vertices.push_back(Point(c).add(prand(-0.5, 0.5)));
+        vertices.push_back(Point(c).add(prand(-0.5, 0.5)));
+        vertices.push_back(Point(c).add(prand(-0.5, 0.5)));
+    }
+    for (int i=0; i<NT; ++i)
+        triangles.push_back(Triangle(&vertices, 3*i, 3*i+1, 3*i+2));
+    for (int i=0; i<NL; ++i)
+        lines.push_back(Line(prand(-2, 2), prand(-2, 2)));
+
+    vector<int> indices(NT);
+    for (int i=0; i<NT; ++i) indices[i] = i;
+    vector<Triangle4> packs4;
+    vector<Triangle8> packs8;
+    for (int i=0; i<NT; i+=4) packs4.push_back(Triangle4(triangles, &indices[i], 4));
+    for (int i=0; i<NT; i+=8) packs8.push_back(Triangle8(triangles, &indices[i], 8));
+
+    double tests = (double)NT*NL, t;
+    vector<char> ref(NT*NL);
+    long hits, diff;
+
+    printf("Ray-triangle: %d segments x %d triangles \n", NL, NT);
+
+    t = Parallel::seconds(); hits = 0;
+    for (int l=0; l<NL; ++l)
+        for (int i=0; i<NT; ++i)
+            hits += ref[l*NT+i] = legacyIntersects(triangles[i], lines[l]);
+    report("legacy", Parallel::seconds()-t, tests, hits, 0);
+
+    t = Parallel::seconds(); hits = diff = 0;
+    for (int l=0; l<NL; ++l)
+        for (int i=0; i<NT; ++i) {
+            bool h = Geom::intersects(triangles[i], lines[l]);
+            hits += h;
+            diff += h != ref[l*NT+i];
+        }
+    report("moller-trumbore", Parallel::seconds()-t, tests, hits, diff);
+
+    t = Parallel::seconds(); hits = diff = 0;
+    for (int l=0; l<NL; ++l)
+        for (int p=0; p<packs4.size(); ++p) {
+            int m = Geom::intersects(packs4[p], lines[l]);
+            for (int i=0; i<4; ++i) {
+                hits += (m>>i)&1;
+                diff += ((m>>i)&1) != ref[l*NT+4*p+i];
+            }
+        }
+#ifdef __SSE2__
+    report("moller-trumbore x4 sse", Parallel::seconds()-t, tests, hits, diff);
+#else
+    report("moller-trumbore x4 scalar", Parallel::seconds()-t, tests, hits, diff);
+#endif
+
+    t = Parallel::seconds(); hits = diff = 0;
+    for (int l=0; l<NL; ++l)
+        for (int p=0; p<packs8.size(); ++p) {
+            int m = Geom::intersects(packs8[p], lines[l]);
+            for (int i=0; i<8; ++i) {
+                hits += (m>>i)&1;
+                diff += ((m>>i)&1) != ref[l*NT+8*p+i];
+            }
+        }
+#ifdef __AVX__
+    report("moller-trumbore x8 avx", Parallel::seconds()-t, tests, hits, diff);
+#else
+    report("moller-trumbore x8 scalar", Parallel::seconds()-t, tests, hits, diff);
+#endif
+}
+
+/**
+ * Loads the two models of the scene with the sizes used by GlVisuals.
+ */
+static void loadModels(Mesh *&armadillo, Mesh *&car, const MeshOptions &opt=MeshOptions())
+{
+    armadillo = new Mesh("Model_1.obj", 1, opt);
+    armadillo->setMaxSize(50);
+    car = new Mesh("Model_2.obj", 0, opt);
+    car->setMaxSize(100.0/3);
+}
+
+void Bench::intersect()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Intersection of the two models, car moved along x: \n");
+    for (int step=0; step<=6; ++step) {
+        Point pos(10*step, 0, 0);
+        car->setPos(pos);
+        const int reps = 5;
+        double t = Parallel::seconds();
+        Mesh *m = NULL;
+        for (int r=0; r<reps; ++r) {
+            delete m;
+            m = new Mesh(*armadillo, *car, 1);
+        }
+        t = (Parallel::seconds()-t)/reps;
+        const CollisionStats &st = m->getCollisionStats();
+        printf("  x=%-3d %8.2f ms | %6d triangles | %8lu node pairs | %10lu triangle pairs \n",
+               10*step, 1000*t, m->getTriangleCount(), st.nodePairs, st.trianglePairs);
+        delete m;
+    }
+
+    printf("Intersection of the two models, car at x=0, by thread count: \n");
+    int threads = Parallel::threadCount();
+    Point origin(0, 0, 0);
+    car->setPos(origin);
+    for (int nt=1; nt<=std::max(8, threads); nt*=2) {
+        Parallel::setThreadCount(nt);
+        const int reps = 5;
+        double t = Parallel::seconds();
+        Mesh *m = NULL;
+        for (int r=0; r<reps; ++r) {
+            delete m;
+            m = new Mesh(*armadillo, *car, 1);
+        }
+        t = (Parallel::seconds()-t)/reps;
+        printf("  %2d threads %8.2f ms | %6d triangles | %10lu triangle pairs \n",
+               nt, 1000*t, m->getTriangleCount(), m->getCollisionStats().trianglePairs);
+        delete m;
+    }
+    Parallel::setThreadCount(threads);
+
+    printf("Intersection of the two models, car at x=20 rotated around y: \n");
+    for (int step=0; step<=4; ++step) {
+        Point pos(20, 0, 0), rot(0, 45*step, 0);
+        car->setPos(pos);
+        car->setRot(rot);
+        double t = Parallel::seconds();
+        Mesh m(*armadillo, *car, 1);
+        t = Parallel::seconds()-t;
+        const CollisionStats &st = m.getCollisionStats();
+        printf("  y=%-3d %8.2f ms | %6d triangles | %8lu node pairs | %10lu triangle pairs \n",
+               45*step, 1000*t, m.getTriangleCount(), st.nodePairs, st.trianglePairs);
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::broadPhase()
+{
+    srand(1);
+    printf("Broad phase: instances of size 10 scattered in a cube, sweep and prune against all pairs: \n");
+    for (int n=100; n<=10000; n*=10) {
+        float side = 10*pow(n, 1/3.0f)*2;
+        vector<Box> boxes;
+        for (int i=0; i<n; ++i) {
+            Point c = prand(0, side);
+            boxes.push_back(Box(Point(c).sub(Point(5,5,5)), Point(c).add(Point(5,5,5))));
+        }
+
+        double t = Parallel::seconds();
+        vector<pair<int,int> > pairs;
+        Geom::overlappingPairs(boxes, pairs);
+        double tsap = Parallel::seconds()-t;
+
+        t = Parallel::seconds();
+        vector<pair<int,int> > all;
+        for (int i=0; i<n; ++i)
+            for (int j=i+1; j<n; ++j)
+                if (Geom::intersects(boxes[i], boxes[j]))
+                    all.push_back(make_pair(i, j));
+        double tall = Parallel::seconds()-t;
+
+        printf("  %5d instances | sweep %8.3f ms | all pairs %8.3f ms | %6lu of %9lu pairs overlap | %s \n",
+               n, 1000*tsap, 1000*tall, (unsigned long)pairs.size(), (unsigned long)n*(n-1)/2,
+               pairs==all ? "same" : "DIFFERENT");
+    }
+}
+
+void Bench::hierarchy()
+{
+    static const struct {
+        const char *name;
+        BvhBuilder builder;
+        int leafSize;
+        int maxDepth;
+        bool exact;
+    } builders[] = {
+        {"midpoint", BVH_MIDPOINT, 0, BVL, false},
+        {"midpoint", BVH_MIDPOINT, 0, BVL, true},
+        {"sah", BVH_SAH, 0, BVL, false},
+        {"midpoint", BVH_MIDPOINT, 16, 16, false},
+        {"midpoint", BVH_MIDPOINT, 16, 16, true},
+        {"sah", BVH_SAH, 16, 32, false},
+        {"sah", BVH_SAH, 8, 32, false},
+        {"sah", BVH_SAH, 4, 32, false},
+        {"lbvh", BVH_LBVH, 8, 32, false},
+    };
+    const int count = sizeof(builders)/sizeof(builders[0]);
+
+    for (int b=0; b<count; ++b) {
+        MeshOptions opt;
+        opt.bvhBuilder = builders[b].builder;
+        opt.leafSize = builders[b].leafSize;
+        opt.maxDepth = builders[b].maxDepth;
+        opt.exactSplit = builders[b].exact;
+        opt.volumeMode = VOLUME_SCANLINE;
+        Mesh *armadillo, *car;
+        loadModels(armadillo, car, opt);
+
+        printf("Hierarchy built with %s%s, leaf size %d, max depth %d: \n", builders[b].name,
+               builders[b].exact ? " (exact split)" : "", builders[b].leafSize, builders[b].maxDepth);
+        Mesh *models[] = {armadillo, car};
+        const char *names[] = {"Model_1", "Model_2"};
+        for (int m=0; m<2; ++m) {
+            BvhStats st = models[m]->getBvhStats();
+            double t = Parallel::seconds();
+            float vol = models[m]->createVoxels();
+            t = Parallel::seconds()-t;
+            printf("  %s  %6d nodes | SAH cost %8.1f | %6.1f triangles per leaf | duplication %5.2f | volume scan %7.2f ms = %.1f \n",
+                   names[m], (int)models[m]->mAABB.size(), st.sahCost, st.avgLeafSize, st.duplication, 1000*t, vol);
+            printf("           duplication by level:");
+            for (int l=0; l<=BVL; ++l)
+                printf(" %.2f", st.levelDuplication[l]);
+            printf(" \n");
+        }
+
+        double t = Parallel::seconds();
+        unsigned long pairs = 0;
+        int triangles = 0;
+        for (int step=0; step<=4; ++step) {
+            Point pos(10*step, 0, 0);
+            car->setPos(pos);
+            Mesh m(*armadillo, *car, 1);
+            pairs += m.getCollisionStats().trianglePairs;
+            triangles += m.getTriangleCount();
+        }
+        t = Parallel::seconds()-t;
+        printf("  intersection at x=0..40 %8.2f ms | %6d triangles | %10lu triangle pairs \n", 1000*t, triangles, pairs);
+
+        delete armadillo;
+        delete car;
+    }
+}
+
+void Bench::traversal()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Traversal of the box hierarchy: \n");
+    Mesh *models[] = {armadillo, car};
+    const char *names[] = {"Model_1", "Model_2"};
+    for (int m=0; m<2; ++m) {
+        Mesh &mesh = *models[m];
+        size_t bytes = mesh.mAABB.size()*sizeof(BvhNode) + mesh.mAABBIndices.size()*sizeof(int);
+
+        VolumeMode modes[] = {VOLUME_RAYS, VOLUME_SCANLINE};
+        double t[2];
+        mesh.mOpt.volumeDivs = 100;
+        for (int i=0; i<2; ++i) {
+            mesh.mOpt.volumeMode = modes[i];
+            t[i] = Parallel::seconds();
+            mesh.createVoxels();
+            t[i] = Parallel::seconds()-t[i];
+        }
+        const Box &b = mesh.getBox();
+        float dl = b.getXSize()/mesh.mOpt.volumeDivs;
+        double rays = (double)mesh.mOpt.volumeDivs * floor(b.getYSize()/dl+0.5) * floor(b.getZSize()/dl+0.5);
+        printf("  %s  %6d nodes | %8lu bytes | ray scan %7.2f ms, %5.2f Mrays/s | column scan %6.2f ms \n",
+               names[m], (int)mesh.mAABB.size(), (unsigned long)bytes, 1000*t[0], rays/t[0]/1e6, 1000*t[1]);
+    }
+
+    const int reps = 5;
+    double t = Parallel::seconds();
+    for (int r=0; r<reps; ++r) {
+        for (int step=0; step<=4; ++step) {
+            Point pos(10*step, 0, 0);
+            car->setPos(pos);
+            Mesh m(*armadillo, *car, 1);
+        }
+    }
+    t = (Parallel::seconds()-t)/reps;
+    printf("  intersection at x=0..40 %8.2f ms \n", 1000*t);
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::build()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Hierarchy build by thread count: \n");
+    Mesh *models[] = {armadillo, car};
+    const char *names[] = {"Model_1", "Model_2"};
+    int threads = Parallel::threadCount();
+    for (int m=0; m<2; ++m) {
+        Mesh &mesh = *models[m];
+
+        /* The single thread build is the reference for the others */
+        Parallel::setThreadCount(1);
+        mesh.createBoundingBoxHierarchy();
+        vector<BvhNode> refNodes = mesh.mAABB;
+        vector<int> refIndices = mesh.mAABBIndices;
+
+        for (int nt=1; nt<=std::max(8, threads); nt*=2) {
+            Parallel::setThreadCount(nt);
+            const int reps = 5;
+            double tBox = Parallel::seconds();
+            for (int r=0; r<reps; ++r)
+                mesh.createBoundingBoxHierarchy();
+            tBox = (Parallel::seconds()-tBox)/reps;
+            bool same = mesh.mAABB.size() == refNodes.size() && mesh.mAABBIndices == refIndices &&
+                        !memcmp(&mesh.mAABB[0], &refNodes[0], refNodes.size()*sizeof(BvhNode));
+
+            double tBoth = Parallel::seconds();
+            for (int r=0; r<reps; ++r)
+                mesh.createBoundingVolHierarchy();
+            tBoth = (Parallel::seconds()-tBoth)/reps;
+
+            printf("  %s  %d threads | boxes %8.2f ms | boxes and spheres %8.2f ms | %s \n",
+                   names[m], nt, 1000*tBox, 1000*tBoth, same ? "identical" : "DIFFERENT");
+        }
+    }
+    Parallel::setThreadCount(threads);
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::refit()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Repeated simplification, hierarchy refitted against rebuilt, by builder: \n");
+    Mesh *models[] = {armadillo, car};
+    const char *names[] = {"Model_1", "Model_2"};
+    BvhBuilder builders[] = {BVH_MIDPOINT, BVH_SAH, BVH_LBVH};
+    const char *builderNames[] = {"midpoint", "sah", "lbvh"};
+    for (int m=0; m<2; ++m)
+    for (int b=0; b<3; ++b) {
+        Mesh mesh(*models[m]);
+        mesh.mOpt.bvhBuilder = builders[b];
+        mesh.createBoundingVolHierarchy();
+        for (int step=1; step<=6; ++step) {
+            double t = Parallel::seconds();
+            mesh.simplify(66);
+            t = Parallel::seconds()-t;
+
+            /* Time both ways of updating the hierarchies on copies of the result */
+            vector<int> same(mesh.mTriangles.size());
+            for (int ti=0; ti<same.size(); ++ti) same[ti] = ti;
+            Mesh refitted(mesh), rebuilt(mesh);
+            double tRefit = Parallel::seconds();
+            refitted.refitBoundingVolHierarchy(same);
+            tRefit = Parallel::seconds()-tRefit;
+            double tBuild = Parallel::seconds();
+            rebuilt.createBoundingVolHierarchy();
+            tBuild = Parallel::seconds()-tBuild;
+
+            /* A refit with the same numbering must leave every leaf with its triangles */
+            bool moved = false;
+            for (int bi=0; bi<mesh.mAABB.size(); ++bi) {
+                const BvhNode &a = mesh.mAABB[bi], &r = refitted.mAABB[bi];
+                if (!a.isLeaf()) continue;
+                if (a.count != r.count || !equal(mesh.mAABBIndices.begin()+a.index, mesh.mAABBIndices.begin()+a.index+a.count,
+                                                 refitted.mAABBIndices.begin()+r.index))
+                    moved = true;
+            }
+            int unreached = unreachedTriangles(refitted);
+
+            printf("  %s %-8s step %d %7d triangles | step %8.2f ms | refit %6.2f ms | rebuild %7.2f ms | SAH cost refitted %.1f, rebuilt %.1f%s",
+                   names[m], builderNames[b], step, mesh.getTriangleCount(), 1000*t, 1000*tRefit, 1000*tBuild,
+                   refitted.getBvhStats().sahCost, rebuilt.getBvhStats().sahCost, moved ? " | MOVED" : "");
+            if (unreached) printf(" | %d triangles in no leaf", unreached);
+            printf(" \n");
+        }
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+int Bench::unreachedTriangles(const Mesh &mesh)
+{
+    vector<bool> reached(mesh.mTriangles.size(), false);
+    for (int bi=0; bi<mesh.mAABB.size(); ++bi) {
+        const BvhNode &node = mesh.mAABB[bi];
+        if (!node.isLeaf()) continue;
+        for (int i=node.index; i<node.index+node.count; ++i)
+            reached[mesh.mAABBIndices[i]] = true;
+    }
+    int unreached = 0;
+    for (int ti=0; ti<reached.size(); ++ti)
+        if (!reached[ti] && !mesh.mTriangles[ti].deleted) ++unreached;
+    return unreached;
+}
+
+void Bench::makeSurface(Mesh &mesh, int triangles)
+{
+    int side = (int)sqrt(triangles/2.0) + 1;
+    mesh.mVertices.clear();
+    mesh.mTriangles.clear();
+    mesh.mVertices.reserve(side*side);
+    mesh.mTriangles.reserve(2*(side-1)*(side-1));
+    for (int i=0; i<side; ++i)
+        for (int j=0; j<side; ++j)
+            mesh.mVertices.push_back(Point(i, j, 10*sin(i*0.05f)*cos(j*0.07f)));
+
+    for (int i=0; i+1<side; ++i) {
+        for (int j=0; j+1<side; ++j) {
+            int v = i*side+j;
+            mesh.mTriangles.push_back(Triangle(&mesh.mVertices, v, v+side, v+1));
+            mesh.mTriangles.push_back(Triangle(&mesh.mVertices, v+1, v+side, v+side+1));
+        }
+    }
+    for (int ti=0; ti<mesh.mTriangles.size(); ++ti)
+        mesh.mTriangles[ti].update();
+}
+
+void Bench::morton()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Box hierarchy build, sah against lbvh: \n");
+    const char *names[] = {"Model_1", "Model_2", "Surface_1M", "Surface_10M"};
+    for (int m=0; m<4; ++m) {
+        Mesh *mesh;
+        if (m==0) mesh = armadillo;
+        else if (m==1) mesh = car;
+        else {
+            mesh = new Mesh(*armadillo);
+            makeSurface(*mesh, m==2 ? 1000000 : 10000000);
+        }
+
+        BvhBuilder builders[] = {BVH_SAH, BVH_LBVH};
+        const char *builderNames[] = {"sah", "lbvh"};
+        for (int b=0; b<2; ++b) {
+            mesh->mOpt.bvhBuilder = builders[b];
+            const int reps = m<2 ? 5 : 1;
+            double t = Parallel::seconds();
+            for (int r=0; r<reps; ++r)
+                mesh->createBoundingBoxHierarchy();
+            t = (Parallel::seconds()-t)/reps;
+            BvhStats st = mesh->getBvhStats();
+
+            /* The leaves must come in node order, and a refit with the
+             * same numbering must keep every triangle and the cost */
+            int outOfOrder = 0, last = -1;
+            for (int bi=0; bi<mesh->mAABB.size(); ++bi) {
+                const BvhNode &node = mesh->mAABB[bi];
+                if (!node.isLeaf() || !node.count) continue;
+                if (node.index < last) ++outOfOrder;
+                last = node.index + node.count;
+            }
+            vector<int> same(mesh->mTriangles.size());
+            for (int ti=0; ti<same.size(); ++ti) same[ti] = ti;
+            mesh->refitBoundingVolHierarchy(same);
+            float refitCost = mesh->getBvhStats().sahCost;
+            int unreached = unreachedTriangles(*mesh);
+
+            printf("  %-12s %9d triangles | %-4s %10.2f ms | %8d nodes | SAH cost %8.1f | %5.1f triangles per leaf | refitted %8.1f",
+                   names[m], mesh->getTriangleCount(), builderNames[b], 1000*t,
+                   (int)mesh->mAABB.size(), st.sahCost, st.avgLeafSize, refitCost);
+            if (outOfOrder) printf(" | %d leaves out of order", outOfOrder);
+            if (unreached) printf(" | %d triangles in no leaf", unreached);
+            printf(" \n");
+        }
+        if (m>=2) delete mesh;
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::collision()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    static const CollisionMode modes[] = {COLLIDE_BOXES, COLLIDE_SPHERES, COLLIDE_HYBRID};
+    static const char *modeNames[] = {"boxes", "spheres", "hybrid"};
+
+    printf("Intersection of the two models by culling volume, car moved along x, then rotated around y at x=20: \n");
+    for (int step=0; step<=11; ++step) {
+        Point pos(step<=6 ? 10*step : 20, 0, 0), rot(0, step<=6 ? 0 : 45*(step-6), 0);
+        car->setPos(pos);
+        car->setRot(rot);
+        double sum0 = 0;
+        int tris0 = 0;
+        for (int mi=0; mi<3; ++mi) {
+            const int reps = 3;
+            double t = Parallel::seconds();
+            Mesh *m = NULL;
+            for (int r=0; r<reps; ++r) {
+                delete m;
+                m = new Mesh(*armadillo, *car, 1, modes[mi]);
+            }
+            t = (Parallel::seconds()-t)/reps;
+
+            /* The triangles come out in another order in each mode,
+             * so they are compared by an order-free sum. */
+            double sum = 0;
+            for (int vi=0; vi<m->mVertices.size(); ++vi)
+                sum += m->mVertices[vi].x + 2*m->mVertices[vi].y + 3*m->mVertices[vi].z;
+            if (mi==0) {
+                sum0 = sum;
+                tris0 = m->getTriangleCount();
+            }
+            bool same = m->getTriangleCount() == tris0 && fabs(sum-sum0) <= 1e-6*(1+fabs(sum0));
+
+            const CollisionStats &st = m->getCollisionStats();
+            printf("  x=%-3d y=%-3d %-7s %8.2f ms | %7lu node pairs | %7lu box %7lu sphere %7lu mixed | %7lu culled | %6lu leaf pairs | %9lu triangle pairs | %6d triangles%s \n",
+                   (int)pos.x, (int)rot.y, modeNames[mi], 1000*t, st.nodePairs, st.boxTests, st.sphereTests,
+                   st.mixedTests, st.culledPairs, st.leafPairs, st.trianglePairs, m->getTriangleCount(),
+                   same ? "" : " | DIFFERENT");
+            delete m;
+        }
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::simplification()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Simplification of a copy of each model, by engine and percentage of the triangles kept: \n");
+    Mesh *models[] = {armadillo, car};
+    const char *names[] = {"Model_1", "Model_2"};
+    const SimplifyEngine engines[] = {SIMPLIFY_NORMALS, SIMPLIFY_QUADRIC};
+    const char *engineNames[] = {"normals", "quadric"};
+    const int percents[] = {90, 75, 50, 25, 10};
+    for (int m=0; m<2; ++m) {
+        float volume = models[m]->exactVolume();
+        for (int e=0; e<2; ++e) {
+            for (int p=0; p<5; ++p) {
+                Mesh mesh(*models[m]);
+                SimplifyOptions opt(percents[p]);
+                opt.engine = engines[e];
+                double t = Parallel::seconds();
+                mesh.simplify(opt);
+                t = Parallel::seconds()-t;
+                printf("  %s %-7s %3d%% %8.2f ms | %7d of %7d triangles | volume %+6.2f%% \n",
+                       names[m], engineNames[e], percents[p], 1000*t, mesh.getTriangleCount(),
+                       models[m]->getTriangleCount(), 100*(mesh.exactVolume()/volume-1));
+            }
+        }
+    }
+
+    printf("Quadric simplification of Model_1 by error and by time budget: \n");
+    const float errors[] = {0.0001f, 0.001f, 0.01f, 0.1f};
+    for (int i=0; i<4; ++i) {
+        Mesh mesh(*armadillo);
+        SimplifyOptions opt;
+        opt.engine = SIMPLIFY_QUADRIC;
+        opt.maxError = errors[i];
+        double t = Parallel::seconds();
+        mesh.simplify(opt);
+        t = Parallel::seconds()-t;
+        printf("  error %-8g %8.2f ms | %7d triangles \n", errors[i], 1000*t, mesh.getTriangleCount());
+    }
+    const float budgets[] = {0.02f, 0.03f, 0.04f};
+    for (int i=0; i<3; ++i) {
+        Mesh mesh(*armadillo);
+        SimplifyOptions opt;
+        opt.engine = SIMPLIFY_QUADRIC;
+        opt.seconds = budgets[i];
+        double t = Parallel::seconds();
+        mesh.simplify(opt);
+        t = Parallel::seconds()-t;
+        printf("  budget %4.0f ms %8.2f ms | %7d triangles \n", 1000*budgets[i], 1000*t, mesh.getTriangleCount());
+    }
+
+    printf("Simplification of large surfaces to 10%%: \n");
+    for (int size=1000000; size<=2000000; size*=2) {
+        for (int e=0; e<2; ++e) {
+            Mesh mesh(*armadillo);
+            makeSurface(mesh, size);
+            mesh.createTriangleLists();
+            mesh.createBoundingVolHierarchy();
+            SimplifyOptions opt(10);
+            opt.engine = engines[e];
+            double t = Parallel::seconds();
+            mesh.simplify(opt);
+            t = Parallel::seconds()-t;
+            printf("  Surface_%dM %-7s %8.2f ms | %7d triangles \n", size/1000000, engineNames[e], 1000*t, mesh.getTriangleCount());
+        }
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::progressive()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Progressive mesh: recording, level switches, against a copy simplified to the same size: \n");
+    Mesh *models[] = {armadillo, car};
+    const char *names[] = {"Model_1", "Model_2"};
+    for (int m=0; m<2; ++m) {
+        Mesh &mesh = *models[m];
+        int n = mesh.getTriangleCount();
+        double t = Parallel::seconds();
+        mesh.createProgressive();
+        t = Parallel::seconds()-t;
+        size_t bytes = mesh.mSplits.size()*sizeof(VertexSplit) + mesh.mSplitCorners.size()*sizeof(int)
+                     + mesh.mLodIndices.size()*sizeof(int) + mesh.mLodVertices.size()*sizeof(Point);
+        printf("  %s record %8.2f ms | %6d collapses | %d to %d triangles | %6.0f KB \n",
+               names[m], 1000*t, (int)mesh.mSplits.size(), n, mesh.mSplits.back().triangles, bytes/1024.0);
+
+        /* Whole range, both ways */
+        t = Parallel::seconds();
+        mesh.setLodTriangles(0);
+        double tDown = Parallel::seconds()-t;
+        t = Parallel::seconds();
+        mesh.setLodTriangles(n);
+        double tUp = Parallel::seconds()-t;
+        printf("  %s full to coarsest %6.3f ms | back %6.3f ms \n", names[m], 1000*tDown, 1000*tUp);
+
+        /* Random levels, and small steps of 1% around them */
+        srand(1);
+        const int jumps = 1000;
+        long collapses = 0;
+        t = Parallel::seconds();
+        for (int j=0; j<jumps; ++j) {
+            int level = mesh.mLodLevel;
+            mesh.setLodTriangles(rand()%n);
+            collapses += abs(mesh.mLodLevel-level);
+        }
+        double tJump = (Parallel::seconds()-t)/jumps;
+        t = Parallel::seconds();
+        for (int j=0; j<jumps; ++j)
+            mesh.setLodTriangles(mesh.getLodTriangles() + (j&1 ? n/100 : -n/100));
+        double tStep = (Parallel::seconds()-t)/jumps;
+        printf("  %s random level %7.3f ms (%.0f collapses) | 1%% step %7.4f ms | %.1f ns per collapse \n",
+               names[m], 1000*tJump, (double)collapses/jumps, 1000*tStep, 1e9*tJump*jumps/collapses);
+
+        /* Back at the top, the triangles must be those of the mesh */
+        mesh.setLodTriangles(n);
+        multiset<vector<int> > full, lod;
+        for (int ti=0; ti<n; ++ti) {
+            vector<int> tri(mesh.mTriangles[ti].v, mesh.mTriangles[ti].v+3);
+            vector<int> ltri(mesh.mLodIndices.begin()+3*ti, mesh.mLodIndices.begin()+3*ti+3);
+            full.insert(tri);
+            lod.insert(ltri);
+        }
+        bool exact = full == lod;
+        for (int vi=0; vi<mesh.mVertices.size(); ++vi)
+            exact = exact && !memcmp(mesh.mLodVertices[vi].data, mesh.mVertices[vi].data, sizeof(mesh.mVertices[vi].data));
+        printf("  %s restored exactly: %s \n", names[m], exact ? "yes" : "NO");
+
+        /* In between, no drawn triangle may use a removed vertex, and the
+         * triangles must be those of a copy with the same collapses */
+        const int fractions[] = {4, 2, 1};
+        for (int f=0; f<3; ++f) {
+            int level = mesh.mSplits.size()*fractions[f]/5;
+            mesh.setLodTriangles(mesh.mSplits[level-1].triangles);
+            vector<bool> gone(mesh.mVertices.size(), false);
+            for (int s=0; s<mesh.mLodLevel; ++s)
+                gone[mesh.mSplits[s].removed] = true;
+            int stale = 0;
+            multiset<vector<int> > drawn, replayed;
+            for (int ti=0; ti<mesh.getLodTriangles(); ++ti) {
+                vector<int> tri(mesh.mLodIndices.begin()+3*ti, mesh.mLodIndices.begin()+3*ti+3);
+                if (gone[tri[0]] || gone[tri[1]] || gone[tri[2]]) ++stale;
+                rotate(tri.begin(), min_element(tri.begin(), tri.end()), tri.end());
+                drawn.insert(tri);
+            }
+            Mesh copy(mesh);
+            copy.simplifyQuadric(mesh.getLodTriangles(), 0, 0);
+            for (int ti=0; ti<copy.mTriangles.size(); ++ti) {
+                if (copy.mTriangles[ti].deleted) continue;
+                vector<int> tri(copy.mTriangles[ti].v, copy.mTriangles[ti].v+3);
+                rotate(tri.begin(), min_element(tri.begin(), tri.end()), tri.end());
+                replayed.insert(tri);
+            }
+            printf("  %s level %5d of %d: %d triangles with removed vertices | replayed copy: %s \n",
+                   names[m], mesh.mLodLevel, (int)mesh.mSplits.size(), stale, drawn == replayed ? "same" : "DIFFERENT");
+        }
+        mesh.setLodTriangles(n);
+
+        const int percents[] = {50, 25, 10, 1};
+        for (int p=0; p<4; ++p) {
+            int target = n*percents[p]/100;
+            t = Parallel::seconds();
+            mesh.setLodTriangles(target);
+            double tLod = Parallel::seconds()-t;
+            mesh.setLodTriangles(n);
+            Mesh copy(mesh);
+            SimplifyOptions opt;
+            opt.engine = SIMPLIFY_QUADRIC;
+            opt.triangles = target;
+            t = Parallel::seconds();
+            copy.simplify(opt);
+            double tCopy = Parallel::seconds()-t;
+            mesh.setLodTriangles(target);
+            printf("  %s %2d%% level %7.3f ms, %6d triangles | simplified copy %8.2f ms, %6d triangles \n",
+                   names[m], percents[p], 1000*tLod, mesh.getLodTriangles(), 1000*tCopy, copy.getTriangleCount());
+            mesh.setLodTriangles(n);
+        }
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+void Bench::parallelSimplification()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Quadric simplification to 10%%, serial against parallel by thread count: \n");
+    int threads = Parallel::threadCount();
+    const char *names[] = {"Model_1", "Model_2", "Surface_1M"};
+    for (int m=0; m<3; ++m) {
+        Mesh *model;
+        if (m==0) model = armadillo;
+        else if (m==1) model = car;
+        else {
+            model = new Mesh(*armadillo);
+            makeSurface(*model, 1000000);
+            model->createTriangleLists();
+            model->createBoundingVolHierarchy();
+        }
+        float volume = model->exactVolume();
+
+        SimplifyOptions opt(10);
+        opt.engine = SIMPLIFY_QUADRIC;
+        double tSerial = 0;
+        double sum0 = 0;
+        for (int nt=0; nt<=32; nt = nt ? 2*nt : 1) {
+            Mesh mesh(*model);
+            opt.parallel = nt > 0;
+            Parallel::setThreadCount(nt ? nt : threads);
+            double t = Parallel::seconds();
+            mesh.simplify(opt);
+            t = Parallel::seconds()-t;
+            if (!nt) tSerial = t;
+
+            /* The parts do not depend on the thread count, so neither should the result */
+            double sum = 0;
+            for (int ti=0; ti<mesh.mTriangles.size(); ++ti)
+                for (int k=0; k<3; ++k)
+                    sum += mesh.mTriangles[ti].v[k] + Geom::dotprod(mesh.mVertices[mesh.mTriangles[ti].v[k]], Point(1,2,3));
+            if (nt == 1) sum0 = sum;
+            char label[16];
+            if (nt) sprintf(label, "%2d threads", nt);
+            else sprintf(label, "serial");
+            printf("  %-10s %-10s %9.2f ms | x%5.2f | %7d triangles", names[m], label, 1000*t, tSerial/t, mesh.getTriangleCount());
+            if (m<2) printf(" | volume %+6.2f%%", 100*(mesh.exactVolume()/volume-1));
+            printf("%s \n", nt > 1 && sum != sum0 ? " | DIFFERENT" : "");
+        }
+        if (m==2) delete model;
+    }
+    Parallel::setThreadCount(threads);
+
+    delete armadillo;
+    delete car;
+}
+
+/**
+ * The lists of the triangles of the vertices as they were built before
+ * the compressed rows, one tree per vertex. Kept as the reference.
+ */
+static void legacyTriangleLists(int vertices, const vector<Triangle> &triangles, vector<set<int> > &lists)
+{
+    lists.clear();
+    lists.resize(vertices);
+    for (int ti=0; ti<triangles.size(); ++ti)
+        for (int k=0; k<3; ++k)
+            lists[triangles[ti].v[k]].insert(ti);
+}
+
+void Bench::adjacency()
+{
+    Mesh *armadillo, *car;
+    loadModels(armadillo, car);
+
+    printf("Triangles of each vertex, sets against compressed rows by thread count: \n");
+    int threads = Parallel::threadCount();
+    const char *names[] = {"Model_1", "Model_2", "Surface_1M", "Surface_4M"};
+    for (int m=0; m<4; ++m) {
+        Mesh *model;
+        if (m==0) model = armadillo;
+        else if (m==1) model = car;
+        else {
+            model = new Mesh(*armadillo);
+            makeSurface(*model, m==2 ? 1000000 : 4000000);
+        }
+        int nv = model->mVertices.size();
+        const vector<Triangle> &tris = model->mTriangles;
+
+        /* A tree node of libstdc++ holds three pointers, the colour and
+         * the int, and malloc adds its own header: about 48 bytes. */
+        vector<set<int> > lists;
+        double t = Parallel::seconds();
+        legacyTriangleLists(nv, tris, lists);
+        double tSets = Parallel::seconds()-t;
+        t = Parallel::seconds();
+        vector<set<int> > listsCopy(lists);
+        double tSetsCopy = Parallel::seconds()-t;
+        size_t setMemory = nv*sizeof(set<int>);
+        for (int v=0; v<nv; ++v)
+            setMemory += lists[v].size()*48;
+        printf("  %-10s %-10s %9.2f ms | copy %8.2f ms | %8.2f MB \n", names[m], "sets",
+               1000*tSets, 1000*tSetsCopy, setMemory/1048576.0);
+        listsCopy.clear();
+
+        for (int nt=1; nt<=8; nt *= 2) {
+            Parallel::setThreadCount(nt);
+            Adjacency adj;
+            t = Parallel::seconds();
+            adj.build(nv, tris);
+            double tRows = Parallel::seconds()-t;
+            t = Parallel::seconds();
+            Adjacency adjCopy(adj);
+            double tRowsCopy = Parallel::seconds()-t;
+
+            long mismatches = 0;
+            for (int v=0; v<nv; ++v)
+                if (adj.size(v) != lists[v].size() || !equal(adj.begin(v), adj.end(v), lists[v].begin()))
+                    ++mismatches;
+
+            char label[16];
+            sprintf(label, "%2d threads", nt);
+            printf("  %-10s %-10s %9.2f ms | copy %8.2f ms | %8.2f MB | x%5.2f build | x%6.2f copy | x%5.2f memory%s \n",
+                   names[m], label, 1000*tRows, 1000*tRowsCopy, adj.memory()/1048576.0,
+                   tSets/tRows, tSetsCopy/tRowsCopy, (double)setMemory/adj.memory(),
+                   mismatches ? " | DIFFERENT" : "");
+        }
+        Parallel::setThreadCount(threads);
+        if (m>=2) delete model;
+    }
+
+    delete armadillo;
+    delete car;
+}
+
+int Bench::run(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        void (*func)();
+    } benches[] = {
+        {"raytri", rayTriangle},
+        {"intersect", intersect},
+        {"broadphase", broadPhase},
+        {"bvh", hierarchy},
+        {"traversal", traversal},
+        {"build", build},
+        {"refit", refit},
+        {"lbvh", morton},
+        {"collision", collision},
+        {"simplify", simplification},
+        {"lod", progressive},
+        {"psimplify", parallelSimplification},
+        {"adjacency", adjacency},
+    };
+    const int count = sizeof(benches)/sizeof(benches[0]);
+
+    for (int b=0; b<count; ++b) {
+        bool selected = argc==0;
+        for (int a=0; a<argc; ++a)
+            if (!strcmp(argv[a], benches[b].name)) selected = true;
+        if (selected) benches[b].func();
+    }
+    return 0;
+}
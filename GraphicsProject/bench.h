@@ -0,0 +1,38 @@
+/** @file bench.h
+ * Definition of class Bench.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+class Mesh;
+
+/**
+ * Class that runs the performance measurements of the project.
+ *
+ * Started with "graphproj --bench [name ...]" instead of the
+ * graphical interface. Results are printed in stdout.
+ */
+class Bench
+{
+    static void rayTriangle ();                 ///< Ray-triangle kernels against the original implementation
+    static void intersect ();                   ///< Mesh intersection of the two models at various distances
+    static void broadPhase ();                  ///< Sweep and prune against all pairs for many scene instances
+    static void hierarchy ();                   ///< Quality of the hierarchy builders and its effect on volume and intersection
+    static void traversal ();                   ///< Memory and traversal speed of the box hierarchy
+    static void build ();                       ///< Hierarchy build time by thread count, checked against the single thread build
+    static void refit ();                       ///< Simplification steps with the hierarchy refitted, against a full rebuild
+    static void morton ();                      ///< Build time of the Morton code builder against the SAH builder, up to 10M triangles
+    static void collision ();                   ///< Mesh intersection culled with boxes, spheres or the tighter of the two
+    static void simplification ();              ///< Simplification time and quality by engine, target size and budget
+    static void progressive ();                 ///< Progressive mesh recording and level switches, against simplifying a copy
+    static void parallelSimplification ();      ///< Quadric simplification on parts of the mesh by thread count, against the serial one
+    static void adjacency ();                   ///< Build time, copy time and memory of the triangles of each vertex, sets against compressed rows
+    static int unreachedTriangles (const Mesh &mesh); ///< Live triangles that no leaf of the box hierarchy holds
+    static void makeSurface (Mesh &mesh, int triangles); ///< Replace the geometry of a mesh with a wavy grid, for the hierarchy builders only
+
+public:
+    static int run (int argc, char *argv[]);    ///< Run the benchmarks named in argv, or all of them
+};
+
+#endif
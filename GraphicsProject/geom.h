@@ -11,9 +11,19 @@
 #include <cfloat>
 #include <vector>
 #include <list>
+#include <set>
+#include <algorithm>
+#include <utility>
 #include <cmath>
 #include <cstdlib>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #ifdef __linux__
 #include <GL/glut.h>
 #else
@@ -165,6 +175,25 @@ struct Line {
     ~Line(void) {}
 };
 
+/**
+ * Struct that contains a line segment prepared for repeated box tests.
+ */
+struct Ray {
+    Point orig;     ///< The starting edge of the segment
+    Point dir;      ///< The vector from the start to the end of the segment
+    Point inv;      ///< The inverse of dir in each dimension
+
+    Ray (const Line &l):
+        orig(l.start),
+        dir(Point(l.end).sub(l.start))
+    {
+        /* Zero components get a huge finite inverse instead of infinity,
+         * so that 0*inv never produces a NaN in the slab test. */
+        for (int i=0; i<3; ++i)
+            inv.data[i] = 1.0f / (dir.data[i]!=0? dir.data[i]: FLT_MIN);
+    }
+};
+
 /**
  * Struct that containts a Box
  */
@@ -206,15 +235,15 @@ struct Box {
     Box(const vector<Point> &vertices) {
         Point min,max;
         min.x = min.y = min.z = FLT_MAX;
-        max.x = max.y = max.z = FLT_MIN;
+        max.x = max.y = max.z = -FLT_MAX;
         vector<Point>::const_iterator vi;
         for (vi=vertices.begin(); vi!=vertices.end(); ++vi) {
-            if      (vi->x > max.x) max.x = vi->x;
-            else if (vi->x < min.x) min.x = vi->x;
-            if      (vi->y > max.y) max.y = vi->y;
-            else if (vi->y < min.y) min.y = vi->y;
-            if      (vi->z > max.z) max.z = vi->z;
-            else if (vi->z < min.z) min.z = vi->z;
+            if (vi->x > max.x) max.x = vi->x;
+            if (vi->x < min.x) min.x = vi->x;
+            if (vi->y > max.y) max.y = vi->y;
+            if (vi->y < min.y) min.y = vi->y;
+            if (vi->z > max.z) max.z = vi->z;
+            if (vi->z < min.z) min.z = vi->z;
         }
         this->min = min;
         this->max = max;
@@ -268,12 +297,51 @@ struct Box {
     }
 
     /**
-     * Get the volume of the box.
+     * Get the volume of the box. An empty box (min > max) has no volume.
      */
     float getVolume() const {
+        if (isEmpty()) return 0;
         return fabs((max.x - min.x)*(max.y - min.y)*(max.z - min.z));
     }
 
+    /**
+     * Get the surface area of the box. An empty box has no area.
+     */
+    float getSurfaceArea() const {
+        if (isEmpty()) return 0;
+        float dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+        return 2*(dx*dy + dy*dz + dz*dx);
+    }
+
+    /**
+     * Grows the box so that it also contains the box b.
+     * Extending an empty box gives b.
+     */
+    Box &extend(const Box &b) {
+        if (b.min.x < min.x) min.x = b.min.x;
+        if (b.min.y < min.y) min.y = b.min.y;
+        if (b.min.z < min.z) min.z = b.min.z;
+        if (b.max.x > max.x) max.x = b.max.x;
+        if (b.max.y > max.y) max.y = b.max.y;
+        if (b.max.z > max.z) max.z = b.max.z;
+        return *this;
+    }
+
+    /**
+     * Returns a box that contains nothing. It is the starting
+     * point for building a box with extend().
+     */
+    static Box empty() {
+        return Box(Point(FLT_MAX, FLT_MAX, FLT_MAX), Point(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+    }
+
+    /**
+     * Checks whether the box contains nothing, ie min > max in some dimension.
+     */
+    bool isEmpty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
     /**
      * Translates the box by adding the point v to both corners
      * that define the box.
@@ -490,6 +558,25 @@ struct Sphere {
         }
     }
 
+    /**
+     * Grows the sphere to the smallest sphere that contains both itself and s.
+     */
+    Sphere &extend(const Sphere &s) {
+        float dx = s.center.x - center.x,
+              dy = s.center.y - center.y,
+              dz = s.center.z - center.z;
+        float d = sqrt(dx*dx + dy*dy + dz*dz);
+        if (d + s.rad <= rad) return *this;
+        if (d + rad <= s.rad) return *this = s;
+        float r = (d + rad + s.rad)/2;
+        float f = (r - rad)/d;
+        center.x += dx*f;
+        center.y += dy*f;
+        center.z += dz*f;
+        rad = r;
+        return *this;
+    }
+
     float getVolume() const {
         return (4.0/3.0)*PI*(rad*rad*rad);
     }
@@ -542,6 +629,96 @@ struct Sphere {
 
 };
 
+/**
+ * Struct that contains a rigid transformation: a rotation followed by a translation.
+ */
+struct Transform {
+    float m[3][3];  ///< The rotation matrix
+    Point t;        ///< The translation
+
+    /** Constructs the identity transformation. */
+    Transform():
+        t(0,0,0)
+    {
+        for (int i=0; i<3; ++i)
+            for (int j=0; j<3; ++j)
+                m[i][j] = i==j;
+    }
+
+    /**
+     * Constructs the transformation that Mesh::draw applies:
+     * translate(pos) * rotX(rot.x) * rotY(rot.y) * rotZ(rot.z).
+     * @param [in] pos The translation.
+     * @param [in] rot The rotation angles around each axis in degrees.
+     */
+    Transform(const Point &pos, const Point &rot):
+        t(pos)
+    {
+        const double toRad = 3.14159265358979323846/180;
+        float cx = cos(rot.x*toRad), sx = sin(rot.x*toRad);
+        float cy = cos(rot.y*toRad), sy = sin(rot.y*toRad);
+        float cz = cos(rot.z*toRad), sz = sin(rot.z*toRad);
+        m[0][0] = cy*cz;            m[0][1] = -cy*sz;           m[0][2] = sy;
+        m[1][0] = sx*sy*cz+cx*sz;   m[1][1] = -sx*sy*sz+cx*cz;  m[1][2] = -sx*cy;
+        m[2][0] = -cx*sy*cz+sx*sz;  m[2][1] = cx*sy*sz+sx*cz;   m[2][2] = cx*cy;
+    }
+
+    /** Rotates a vector. */
+    Point rotate(const Point &v) const {
+        return Point(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                     m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                     m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+    }
+
+    /** Transforms a point. */
+    Point apply(const Point &p) const {
+        return rotate(p).add(t);
+    }
+
+    /**
+     * Transforms a box and returns the smallest box
+     * that contains the result. Empty boxes stay empty.
+     */
+    Box apply(const Box &b) const {
+        if (b.isEmpty()) return b;
+        Point c = apply(Point(b.min).add(b.max).scale(0.5f));
+        Point e = Point(b.max).sub(b.min).scale(0.5f);
+        Point r;
+        for (int i=0; i<3; ++i)
+            r.data[i] = fabs(m[i][0])*e.x + fabs(m[i][1])*e.y + fabs(m[i][2])*e.z;
+        return Box(Point(c).sub(r), Point(c).add(r));
+    }
+
+    /** Returns the transformation that undoes this one. */
+    Transform inverse() const {
+        Transform inv;
+        for (int i=0; i<3; ++i)
+            for (int j=0; j<3; ++j)
+                inv.m[i][j] = m[j][i];
+        inv.t = inv.rotate(t).scale(-1);
+        return inv;
+    }
+
+    bool operator== (const Transform &tr) const {
+        for (int i=0; i<3; ++i)
+            for (int j=0; j<3; ++j)
+                if (m[i][j] != tr.m[i][j]) return false;
+        return t.x==tr.t.x && t.y==tr.t.y && t.z==tr.t.z;
+    }
+
+    bool operator!= (const Transform &tr) const { return !(*this == tr); }
+
+    /** Returns the transformation that applies tr first and then this one. */
+    Transform operator* (const Transform &tr) const {
+        Transform res;
+        for (int i=0; i<3; ++i)
+            for (int j=0; j<3; ++j)
+                res.m[i][j] = m[i][0]*tr.m[0][j] + m[i][1]*tr.m[1][j] + m[i][2]*tr.m[2][j];
+        res.t = apply(tr.t);
+        return res;
+    }
+};
+
 /**
  * Struct that contains a triangle.
  *
@@ -631,8 +808,140 @@ struct Triangle {
     }
 };
 
+/**
+ * Struct that contains N triangles in structure-of-arrays layout,
+ * for testing them against one line at once.
+ *
+ * Each triangle is stored as its first vertex and its two edges
+ * from that vertex. Unused slots have zero edges and never intersect.
+ */
+template <int N>
+struct TrianglePack {
+    float v0x[N], v0y[N], v0z[N];   ///< First vertex of each triangle
+    float e1x[N], e1y[N], e1z[N];   ///< Edge v1->v2 of each triangle
+    float e2x[N], e2y[N], e2z[N];   ///< Edge v1->v3 of each triangle
+    int index[N];                   ///< Index of each triangle in its vector
+    int count;                      ///< Number of used slots
+
+    TrianglePack(): count(0) {
+        for (int i=0; i<N; ++i) set(i, Point(), Point(), Point(), -1);
+    }
+
+    /**
+     * Packs up to N triangles of a vector.
+     * @param [in] triangles The vector containing the triangles.
+     * @param [in] indices The indices of the triangles to pack.
+     * @param [in] n The number of indices, N at most.
+     */
+    TrianglePack(const vector<Triangle> &triangles, const int *indices, int n): count(n) {
+        for (int i=0; i<N; ++i) {
+            if (i<n) {
+                const Triangle &t = triangles[indices[i]];
+                set(i, t.v1(), t.v2(), t.v3(), indices[i]);
+            }
+            else set(i, Point(), Point(), Point(), -1);
+        }
+    }
+
+    void set(int i, const Point &a, const Point &b, const Point &c, int idx) {
+        v0x[i] = a.x;     v0y[i] = a.y;     v0z[i] = a.z;
+        e1x[i] = b.x-a.x; e1y[i] = b.y-a.y; e1z[i] = b.z-a.z;
+        e2x[i] = c.x-a.x; e2y[i] = c.y-a.y; e2z[i] = c.z-a.z;
+        index[i] = idx;
+    }
+};
+
+typedef TrianglePack<4> Triangle4;
+typedef TrianglePack<8> Triangle8;
+
 class Geom {
 
+    /** Whether p lies outside s, allowing for rounding */
+    static bool outside (const Sphere &s, const Point &p)
+    {
+        float dx=s.center.x-p.x, dy=s.center.y-p.y, dz=s.center.z-p.z;
+        return dx*dx+dy*dy+dz*dz > s.rad*s.rad*(1+1e-5f);
+    }
+
+    /** The smallest sphere with a and b on its surface */
+    static Sphere sphereThrough (const Point &a, const Point &b)
+    {
+        Point c = Point(a).add(b).scale(0.5f);
+        return Sphere(c, distance(a, b)/2);
+    }
+
+    /**
+     * The smallest sphere with a, b and c on its surface. For points on
+     * a line, the sphere of the two farthest ones.
+     */
+    static Sphere sphereThrough (const Point &a, const Point &b, const Point &c)
+    {
+        double u[3], v[3], w[3];
+        for (int k=0; k<3; ++k) {
+            u[k] = b.data[k]-a.data[k];
+            v[k] = c.data[k]-a.data[k];
+        }
+        w[0] = u[1]*v[2]-u[2]*v[1];
+        w[1] = u[2]*v[0]-u[0]*v[2];
+        w[2] = u[0]*v[1]-u[1]*v[0];
+        double ww = w[0]*w[0]+w[1]*w[1]+w[2]*w[2];
+        double uu = u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
+        double vv = v[0]*v[0]+v[1]*v[1]+v[2]*v[2];
+        if (ww <= 1e-12*uu*vv) {
+            Sphere s = sphereThrough(a, b);
+            if (!outside(s, c)) return s;
+            Sphere s2 = sphereThrough(a, c), s3 = sphereThrough(b, c);
+            return s2.rad > s3.rad ? s2 : s3;
+        }
+
+        /* centre = a + (|u|^2 (v x w) + |v|^2 (w x u)) / 2|w|^2 */
+        double o[3];
+        for (int k=0; k<3; ++k) {
+            int k1 = (k+1)%3, k2 = (k+2)%3;
+            o[k] = (uu*(v[k1]*w[k2]-v[k2]*w[k1]) + vv*(w[k1]*u[k2]-w[k2]*u[k1])) / (2*ww);
+        }
+        Point centre(a.x+o[0], a.y+o[1], a.z+o[2]);
+        return Sphere(centre, sqrt(o[0]*o[0]+o[1]*o[1]+o[2]*o[2]));
+    }
+
+    /**
+     * The sphere with a, b, c and d on its surface. For points on a
+     * plane, the smallest sphere through three of them that holds the
+     * fourth.
+     */
+    static Sphere sphereThrough (const Point &a, const Point &b, const Point &c, const Point &d)
+    {
+        double u[3], v[3], t[3];
+        for (int k=0; k<3; ++k) {
+            u[k] = b.data[k]-a.data[k];
+            v[k] = c.data[k]-a.data[k];
+            t[k] = d.data[k]-a.data[k];
+        }
+        double vt[3] = {v[1]*t[2]-v[2]*t[1], v[2]*t[0]-v[0]*t[2], v[0]*t[1]-v[1]*t[0]};
+        double tu[3] = {t[1]*u[2]-t[2]*u[1], t[2]*u[0]-t[0]*u[2], t[0]*u[1]-t[1]*u[0]};
+        double uv[3] = {u[1]*v[2]-u[2]*v[1], u[2]*v[0]-u[0]*v[2], u[0]*v[1]-u[1]*v[0]};
+        double det = 2*(u[0]*vt[0]+u[1]*vt[1]+u[2]*vt[2]);
+        double uu = u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
+        double vv = v[0]*v[0]+v[1]*v[1]+v[2]*v[2];
+        double tt = t[0]*t[0]+t[1]*t[1]+t[2]*t[2];
+        if (fabs(det) <= 1e-9*sqrt(uu*vv*tt)) {
+            Sphere cand[4] = {sphereThrough(a, b, c), sphereThrough(a, b, d),
+                              sphereThrough(a, c, d), sphereThrough(b, c, d)};
+            const Point *other[4] = {&d, &c, &b, &a};
+            int best = -1;
+            for (int i=0; i<4; ++i)
+                if (!outside(cand[i], *other[i]) && (best<0 || cand[i].rad < cand[best].rad))
+                    best = i;
+            return best<0 ? cand[0].extend(Sphere(d, 0)) : cand[best];
+        }
+
+        double o[3];
+        for (int k=0; k<3; ++k)
+            o[k] = (uu*vt[k] + vv*tu[k] + tt*uv[k]) / det;
+        Point centre(a.x+o[0], a.y+o[1], a.z+o[2]);
+        return Sphere(centre, sqrt(o[0]*o[0]+o[1]*o[1]+o[2]*o[2]));
+    }
+
 public:
 
     /**
@@ -694,6 +1003,53 @@ public:
 
     }
 
+    /**
+     * Finds the smallest sphere that contains some vertices, with Welzl's
+     * randomised incremental algorithm. It takes expected linear time.
+     * @param [in] vertices The vertex list.
+     * @param [in,out] indices The vertices to enclose. They are shuffled.
+     */
+    static Sphere enclosingSphere (const vector<Point> &vertices, vector<int> &indices)
+    {
+        int n = indices.size();
+        if (!n) return Sphere();
+
+        /* A fixed shuffle, so that the result is repeatable */
+        unsigned int seed = 12345;
+        for (int i=n-1; i>0; --i) {
+            seed = seed*1103515245u + 12345u;
+            std::swap(indices[i], indices[(seed>>8) % (i+1)]);
+        }
+
+        /* Each point outside the current sphere lies on the surface of
+         * the smallest sphere of the points so far */
+        Sphere s(vertices[indices[0]], 0);
+        for (int i=1; i<n; ++i) {
+            const Point &pi = vertices[indices[i]];
+            if (!outside(s, pi)) continue;
+            s = Sphere(pi, 0);
+            for (int j=0; j<i; ++j) {
+                const Point &pj = vertices[indices[j]];
+                if (!outside(s, pj)) continue;
+                s = sphereThrough(pi, pj);
+                for (int k=0; k<j; ++k) {
+                    const Point &pk = vertices[indices[k]];
+                    if (!outside(s, pk)) continue;
+                    s = sphereThrough(pi, pj, pk);
+                    for (int l=0; l<k; ++l) {
+                        const Point &pl = vertices[indices[l]];
+                        if (outside(s, pl)) s = sphereThrough(pi, pj, pk, pl);
+                    }
+                }
+            }
+        }
+
+        /* Take up any rounding, so that every vertex is inside */
+        for (int i=0; i<n; ++i)
+            s.rad = std::max(s.rad, distance(s.center, vertices[indices[i]]));
+        return s;
+    }
+
     /**
      * Produces the code that is used from the
      * Cohen – Sutherland algorithm.
@@ -717,74 +1073,336 @@ public:
                (b1.min.z < b2.max.z) && (b1.max.z > b2.min.z);
     }
 
+    /**
+     * Same as intersects(), but boxes that only touch, or that are flat
+     * on the plane where the other one ends, also count.
+     */
+    static bool touches (const Box &b1, const Box &b2)
+    {
+        return (b1.min.x <= b2.max.x) && (b1.max.x >= b2.min.x) &&
+               (b1.min.y <= b2.max.y) && (b1.max.y >= b2.min.y) &&
+               (b1.min.z <= b2.max.z) && (b1.max.z >= b2.min.z);
+    }
+
+    /**
+     * Checks whether a triangle touches a box, with the separating axis
+     * test. Like touches() for two boxes, contact on the boundary counts.
+     */
+    static bool touches (const Box &b, const Triangle &t)
+    {
+        if (!touches(b, t.box)) return false;
+
+        /* Work around the centre of the box */
+        Point c = Point(b.min).add(b.max).scale(0.5f);
+        Point h = Point(b.max).sub(b.min).scale(0.5f);
+        Point v[3] = {Point(t.v1()).sub(c), Point(t.v2()).sub(c), Point(t.v3()).sub(c)};
+        Point e[3] = {Point(v[1]).sub(v[0]), Point(v[2]).sub(v[1]), Point(v[0]).sub(v[2])};
+
+        /* The axes normal to an edge of the triangle and an edge of the box */
+        for (int i=0; i<3; ++i) {
+            Point axes[3] = {Point(0, -e[i].z, e[i].y), Point(e[i].z, 0, -e[i].x), Point(-e[i].y, e[i].x, 0)};
+            for (int k=0; k<3; ++k) {
+                const Point &a = axes[k];
+                float p0 = dotprod(a, v[0]), p1 = dotprod(a, v[1]), p2 = dotprod(a, v[2]);
+                float r = h.x*fabs(a.x) + h.y*fabs(a.y) + h.z*fabs(a.z);
+                if (std::min(p0, std::min(p1, p2)) > r || std::max(p0, std::max(p1, p2)) < -r)
+                    return false;
+            }
+        }
+
+        /* The normal of the triangle. The box normals were tested with the boxes. */
+        Point n = crossprod(e[0], e[1]);
+        float r = h.x*fabs(n.x) + h.y*fabs(n.y) + h.z*fabs(n.z);
+        return fabs(dotprod(n, v[0])) <= r;
+    }
+
+    static bool intersects (const Sphere &s1, const Sphere &s2)
+    {
+        float r = s1.rad + s2.rad;
+        float dx = s1.center.x-s2.center.x, dy = s1.center.y-s2.center.y, dz = s1.center.z-s2.center.z;
+        return dx*dx + dy*dy + dz*dz < r*r;
+    }
+
+    /**
+     * Checks whether a box and a sphere overlap, by the distance of
+     * the centre of the sphere from the box.
+     */
+    static bool intersects (const Box &b, const Sphere &s)
+    {
+        float d2 = 0;
+        for (int k=0; k<3; ++k) {
+            float c = s.center.data[k];
+            if (c < b.min.data[k]) d2 += (b.min.data[k]-c)*(b.min.data[k]-c);
+            else if (c > b.max.data[k]) d2 += (c-b.max.data[k])*(c-b.max.data[k]);
+        }
+        return d2 < s.rad*s.rad;
+    }
+
     static bool intersects (const Box &b, const Line &l)
     {
-        /* local variables declare static in order to
-           reduce the storage required for recursion */
-        static char c1, c2, bit, axis;
-        static float tdl;
-        static Point dl, i;
-        static vector<Point> Rv(3);
-        static Triangle R = Triangle(&Rv, 0,1,2);
+        return intersects(b, Ray(l));
+    }
 
-        /* Trivial accept / reject */
-        c1 = mkcode(l.start, b);
-        c2 = mkcode(l.end, b);
+    /**
+     * Finds all the pairs of boxes that intersect, with sweep and prune.
+     * The boxes are sorted on the axis along which their centers vary the
+     * most, and each box is only tested against the boxes that start before
+     * it ends on that axis. Empty boxes never intersect.
+     * @param [in] boxes The boxes to test.
+     * @param [out] pairs The pairs (i,j) with i<j of intersecting boxes, in ascending order.
+     */
+    static void overlappingPairs (const vector<Box> &boxes, vector<pair<int,int> > &pairs)
+    {
+        pairs.clear();
+        int n = boxes.size();
+        if (n < 2) return;
+
+        /* Pick the axis of the largest variance of the centers */
+        double sum[3] = {0,0,0}, sum2[3] = {0,0,0};
+        for (int i=0; i<n; ++i) {
+            for (int a=0; a<3; ++a) {
+                double c = 0.5*(boxes[i].min.data[a] + boxes[i].max.data[a]);
+                sum[a] += c;
+                sum2[a] += c*c;
+            }
+        }
+        int axis = 0;
+        double var[3];
+        for (int a=0; a<3; ++a) {
+            var[a] = sum2[a]/n - (sum[a]/n)*(sum[a]/n);
+            if (var[a] > var[axis]) axis = a;
+        }
 
-        if (!(c1 | c2)) return true;
-        if ( (c1 & c2)) return false;
-        if ( !c1||!c2)  return true;
+        /* Sort by the start on that axis and sweep */
+        vector<pair<float,int> > order;
+        for (int i=0; i<n; ++i)
+            if (!boxes[i].isEmpty())
+                order.push_back(make_pair(boxes[i].min.data[axis], i));
+        sort(order.begin(), order.end());
+
+        for (int oi=0; oi<order.size(); ++oi) {
+            int i = order[oi].second;
+            float end = boxes[i].max.data[axis];
+            for (int oj=oi+1; oj<order.size() && order[oj].first < end; ++oj) {
+                int j = order[oj].second;
+                if (intersects(boxes[i], boxes[j]))
+                    pairs.push_back(make_pair(std::min(i,j), std::max(i,j)));
+            }
+        }
+        sort(pairs.begin(), pairs.end());
+    }
 
-        return true; // return prematurely because the code below is incorrect
+    /**
+     * Slab test of a box against a line segment.
+     */
+    static bool intersects (const Box &b, const Ray &r)
+    {
+        float tnear = 0, tfar = 1;
+        for (int i=0; i<3; ++i) {
+            float t1 = (b.min.data[i] - r.orig.data[i]) * r.inv.data[i];
+            float t2 = (b.max.data[i] - r.orig.data[i]) * r.inv.data[i];
+            /* Swap by direction rather than by value, so that empty boxes are never hit */
+            if (r.inv.data[i] < 0) std::swap(t1, t2);
+            tnear = std::max(tnear, t1);
+            tfar  = std::min(tfar,  t2);
+        }
+        return tnear <= tfar;
+    }
 
-        /* Find a plane of intersection */
-        bit = -1;
-        while (!((c1^c2) & (1<<(++bit))));
-        axis = 2-bit/2;
+    /**
+     * Slab test of two boxes against a line segment at once,
+     * eg the two children of a hierarchy node.
+     * @return Bitmask with bit 0 set if b0 is crossed and bit 1 if b1 is crossed.
+     */
+    static int intersects (const Box &b0, const Box &b1, const Ray &r)
+    {
+#ifdef __SSE2__
+        /* The 4 lanes hold [near0, near1, far0, far1] */
+        __m128 acc = _mm_set_ps(1, 1, 0, 0);
+        for (int i=0; i<3; ++i) {
+            __m128 t = _mm_set_ps(b1.max.data[i], b0.max.data[i], b1.min.data[i], b0.min.data[i]);
+            t = _mm_mul_ps(_mm_sub_ps(t, _mm_set1_ps(r.orig.data[i])), _mm_set1_ps(r.inv.data[i]));
+            if (r.inv.data[i] < 0) t = _mm_shuffle_ps(t, t, _MM_SHUFFLE(1,0,3,2));
+            acc = _mm_shuffle_ps(_mm_max_ps(acc, t), _mm_min_ps(acc, t), _MM_SHUFFLE(3,2,1,0));
+        }
+        return _mm_movemask_ps(_mm_cmple_ps(acc, _mm_movehl_ps(acc, acc))) & 3;
+#else
+        return intersects(b0, r) | (intersects(b1, r) << 1);
+#endif
+    }
 
-        /* Construct a triangle on the plane of intersection */
-        Rv[0] = Rv[1] = Rv[2] = bit%2? b.min: b.max;
-        Rv[1].data[(axis+1)%3]+=10;     // keep the value on the plane axis
-        Rv[2].data[(axis+2)%3]+=10;     // and alter the values on other 2 axes
-        R.update();                     // Force the triangle to compute its coefficients
+    /**
+     * Intersects the line segment [o, o+d] with the triangle that has
+     * vertex v0 and edges e1, e2 (Moller-Trumbore).
+     *
+     * The segment must cross the interior of the triangle. Segments that
+     * lie on the plane of the triangle never intersect it.
+     */
+    static bool intersectsSegment (const Point &v0, const Point &e1, const Point &e2, const Point &o, const Point &d)
+    {
+        Vector3f p = crossprod(d, e2);
+        float det = dotprod(e1, p);
+        if (det == 0) return false;
+        float inv = 1.0f/det;
 
-        /* Find the point of intersection */
-        dl = Point(l.end).sub(l.start);
-        tdl = -R.planeEquation(l.start)/(R.planeEquation(dl)- R.D);
-        i = Point(l.start).add(dl.scale(tdl));
+        Vector3f s(o.x-v0.x, o.y-v0.y, o.z-v0.z);
+        float u = dotprod(s, p)*inv;
+        if (!(u > 0 && u < 1)) return false;
 
-        return (rand()%2)? intersects(b, Line(l.start, i)) : intersects(b, Line(i, l.end));
+        Vector3f q = crossprod(s, e1);
+        float v = dotprod(d, q)*inv;
+        if (!(v > 0 && u+v < 1)) return false;
+
+        float t = dotprod(e2, q)*inv;
+        return t >= 0 && t <= 1;
     }
 
     static bool intersects (const Triangle &t, const Line &l)
     {
-        if (t.planeEquation(l.start) * t.planeEquation(l.end) > 0)
+        const Point &v0 = t.v1();
+        return intersectsSegment(v0,
+                                 Point(t.v2()).sub(v0),
+                                 Point(t.v3()).sub(v0),
+                                 l.start,
+                                 Point(l.end).sub(l.start));
+    }
+
+    /**
+     * Intersects a line segment with 4 triangles at once.
+     * @return Bitmask with bit i set if the triangle in slot i is crossed.
+     */
+    static int intersects (const Triangle4 &t, const Line &l)
+    {
+#ifdef __SSE2__
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+        __m128 dx = _mm_set1_ps(l.end.x-l.start.x);
+        __m128 dy = _mm_set1_ps(l.end.y-l.start.y);
+        __m128 dz = _mm_set1_ps(l.end.z-l.start.z);
+        __m128 e1x = _mm_loadu_ps(t.e1x), e1y = _mm_loadu_ps(t.e1y), e1z = _mm_loadu_ps(t.e1z);
+        __m128 e2x = _mm_loadu_ps(t.e2x), e2y = _mm_loadu_ps(t.e2y), e2z = _mm_loadu_ps(t.e2z);
+
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 inv = _mm_div_ps(one, det);
+
+        __m128 sx = _mm_sub_ps(_mm_set1_ps(l.start.x), _mm_loadu_ps(t.v0x));
+        __m128 sy = _mm_sub_ps(_mm_set1_ps(l.start.y), _mm_loadu_ps(t.v0y));
+        __m128 sz = _mm_sub_ps(_mm_set1_ps(l.start.z), _mm_loadu_ps(t.v0z));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v  = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+        __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+        __m128 mask = _mm_cmpneq_ps(det, zero);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, one)));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(_mm_add_ps(u, v), one)));
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(tt, zero), _mm_cmple_ps(tt, one)));
+        return _mm_movemask_ps(mask) & ((1<<t.count)-1);
+#else
+        return intersectsScalar(t, l);
+#endif
+    }
+
+    /**
+     * Intersects a line segment with 8 triangles at once.
+     * @return Bitmask with bit i set if the triangle in slot i is crossed.
+     */
+    static int intersects (const Triangle8 &t, const Line &l)
+    {
+#ifdef __AVX__
+        const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+        __m256 dx = _mm256_set1_ps(l.end.x-l.start.x);
+        __m256 dy = _mm256_set1_ps(l.end.y-l.start.y);
+        __m256 dz = _mm256_set1_ps(l.end.z-l.start.z);
+        __m256 e1x = _mm256_loadu_ps(t.e1x), e1y = _mm256_loadu_ps(t.e1y), e1z = _mm256_loadu_ps(t.e1z);
+        __m256 e2x = _mm256_loadu_ps(t.e2x), e2y = _mm256_loadu_ps(t.e2y), e2z = _mm256_loadu_ps(t.e2z);
+
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+        __m256 inv = _mm256_div_ps(one, det);
+
+        __m256 sx = _mm256_sub_ps(_mm256_set1_ps(l.start.x), _mm256_loadu_ps(t.v0x));
+        __m256 sy = _mm256_sub_ps(_mm256_set1_ps(l.start.y), _mm256_loadu_ps(t.v0y));
+        __m256 sz = _mm256_sub_ps(_mm256_set1_ps(l.start.z), _mm256_loadu_ps(t.v0z));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv);
+
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        __m256 v  = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+        __m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+
+        __m256 mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(u, one, _CMP_LT_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GT_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LT_OQ)));
+        mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(tt, zero, _CMP_GE_OQ), _mm256_cmp_ps(tt, one, _CMP_LE_OQ)));
+        return _mm256_movemask_ps(mask) & ((1<<t.count)-1);
+#else
+        return intersectsScalar(t, l);
+#endif
+    }
+
+    /**
+     * Intersects a line segment with the triangles of a pack one by one.
+     * Used when the SIMD instructions are not available.
+     */
+    template <int N>
+    static int intersectsScalar (const TrianglePack<N> &t, const Line &l)
+    {
+        Point d = Point(l.end).sub(l.start);
+        int mask = 0;
+        for (int i=0; i<t.count; ++i) {
+            if (intersectsSegment(Point(t.v0x[i], t.v0y[i], t.v0z[i]),
+                                  Point(t.e1x[i], t.e1y[i], t.e1z[i]),
+                                  Point(t.e2x[i], t.e2y[i], t.e2z[i]), l.start, d))
+                mask |= 1<<i;
+        }
+        return mask;
+    }
+
+    /**
+     * Intersects a triangle with the vertical line (x,y,*).
+     *
+     * Points on an edge are assigned to one side only, so that a line through
+     * an edge shared by two triangles of a surface hits exactly one of them.
+     * @param [out] z The height at which the line meets the triangle.
+     * @return True if the line meets the triangle.
+     */
+    static bool intersectsColumn (const Triangle &t, float x, float y, float &z)
+    {
+        if (x < t.box.min.x || x > t.box.max.x || y < t.box.min.y || y > t.box.max.y || t.C == 0)
             return false;
-        else
-        {
-            /* Find the intersection point */
-            Point dl = Point(l.end).sub(l.start);
-            float tdl = -t.planeEquation(l.start)/(t.planeEquation(dl)- t.D);
-            Point i = Point(l.start).add(dl.scale(tdl));
-
-            /* Temporary vector containing the 6 vertices
-             * that form the 3 perpendicular planes around the triangle */
-            Point N(t.getNormal());
-            vector<Point> tempVec(6);
-            tempVec[0] = tempVec[3] = t.v1();
-            tempVec[1] = tempVec[4] = t.v2();
-            tempVec[2] = tempVec[5] = t.v3();
-            tempVec[3].add(N);
-            tempVec[4].add(N);
-            tempVec[5].add(N);
-            float eq1 = Triangle(&tempVec, 0, 1, 3).planeEquation(i);
-            float eq2 = Triangle(&tempVec, 1, 2, 4).planeEquation(i);
-            float eq3 = Triangle(&tempVec, 2, 3, 5).planeEquation(i);
-
-            if ( (eq1>0 && eq2>0 && eq3>0) || (eq1<0 && eq2<0 && eq3<0) )
-                return true;
-            else return false;
+
+        const Point *p[3] = {&t.v1(), &t.v2(), &t.v3()};
+        double w[3], area=0;
+        for (int i=0; i<3; ++i) {
+            const Point &a = *p[i], &b = *p[(i+1)%3];
+            w[i] = ((double)b.x-a.x)*((double)y-a.y) - ((double)b.y-a.y)*((double)x-a.x);
+            area += w[i];
         }
+        if (area == 0) return false;
+
+        /* Orient counter-clockwise and apply a top-left style tie rule on the edges */
+        float sign = area > 0? 1: -1;
+        for (int i=0; i<3; ++i) {
+            double wi = sign*w[i];
+            if (wi < 0) return false;
+            if (wi == 0) {
+                float dx = sign*(p[(i+1)%3]->x - p[i]->x);
+                float dy = sign*(p[(i+1)%3]->y - p[i]->y);
+                if (!(dy < 0 || (dy == 0 && dx > 0))) return false;
+            }
+        }
+
+        z = -(t.A*x + t.B*y + t.D)/t.C;
+        return true;
     }
 
     static bool intersects (const Triangle &t1, const Triangle &t2)
@@ -3,6 +3,7 @@
  */
 
 #include <cstdio>
+#include <ctime>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -29,7 +30,8 @@ GlVisuals::GlVisuals():
     milli0 (-1),
     t (0.0),
     style (SOLID),
-    bvlStyle(AABB)
+    bvlStyle(AABB),
+    lod_mode(false)
 {
     loadScene();
 }
@@ -42,8 +44,7 @@ GlVisuals::~GlVisuals()
     for (int i=0; i<car.size(); ++i)
         delete car[i];
 
-    for (int i=0; i<intersection.size(); ++i)
-        delete intersection[i];
+    clearIntersections();
 }
 
 /** Manage scene */
@@ -75,9 +76,6 @@ void GlVisuals::resetScene()
     car.resize(1);
     car[0]->setPos(zero);
 
-    for (int i=0; i<intersection.size(); ++i) delete intersection[i];
-    intersection.resize(0);
-
     globRot = globRot0;
     globTrans = globTrans0;
 
@@ -86,18 +84,78 @@ void GlVisuals::resetScene()
 
 void GlVisuals::intersectScene()
 {
-    for (int i=0; i<intersection.size(); ++i)
-        delete intersection[i];
+    clock_t t = clock();
 
-    intersection.clear();
+    /* Broad phase: only the meshes whose world boxes overlap are intersected.
+     * The armadillos come first, so m1 of each pair is always an armadillo. */
+    vector<Mesh*> meshes(armadillo);
+    meshes.insert(meshes.end(), car.begin(), car.end());
+
+    vector<Box> boxes;
+    for (int i=0; i<meshes.size(); ++i)
+        boxes.push_back(meshes[i]->getWorldBox());
 
-    for (int i=0; i<armadillo.size(); ++i) {
-        for (int j=0; j<car.size(); ++j)
-            intersection.push_back (new Mesh(*armadillo[i], *car[j], 1));
+    vector<pair<int,int> > pairs;
+    Geom::overlappingPairs(boxes, pairs);
 
-        for (int k=i+1; k<armadillo.size(); ++k)
-            intersection.push_back (new Mesh(*armadillo[i], *armadillo[k], 1));
+    /* Narrow phase. Cars are not intersected with each other. A pair is only
+     * intersected again if one of its meshes was edited or if they moved
+     * relative to each other. Pairs that no longer overlap are dropped. */
+    map<pair<int,int>, PairIntersection> cache;
+    map<pair<int,int>, PairIntersection>::iterator ci;
+    int candidates=0, reused=0;
+
+    intersection.clear();
+    for (int p=0; p<pairs.size(); ++p) {
+        Mesh &m1 = *meshes[pairs[p].first];
+        Mesh &m2 = *meshes[pairs[p].second];
+        if (pairs[p].first >= armadillo.size()) continue;
+        ++candidates;
+
+        pair<int,int> key(m1.getId(), m2.getId());
+        Transform rel = m1.getTransform().inverse() * m2.getTransform();
+
+        ci = intersectionCache.find(key);
+        if (ci != intersectionCache.end() && ci->second.rel == rel &&
+            ci->second.version1 == m1.getVersion() && ci->second.version2 == m2.getVersion()) {
+            cache[key] = ci->second;
+            intersectionCache.erase(ci);
+            ++reused;
+        } else {
+            PairIntersection &pi = cache[key];
+            pi.rel = rel;
+            pi.version1 = m1.getVersion();
+            pi.version2 = m2.getVersion();
+            pi.mesh = new Mesh(m1, m2, 1);
+            if (!pi.mesh->getTriangleCount()) {
+                delete pi.mesh;
+                pi.mesh = NULL;
+            }
+        }
+
+        /* The intersection is in the frame of m1, so it follows m1 around */
+        Mesh *m = cache[key].mesh;
+        if (m) {
+            Point pos = m1.getPos(), rot = m1.getLocalRot();
+            m->setPos(pos);
+            m->setRot(rot);
+            intersection.push_back(m);
+        }
     }
+
+    clearIntersections();
+    intersectionCache.swap(cache);
+
+    printf ("Scene intersection took:\t%4.2f sec | %d candidate pairs | %d reused \n",
+            ((float)clock()-t)/CLOCKS_PER_SEC, candidates, reused);
+}
+
+void GlVisuals::clearIntersections()
+{
+    map<pair<int,int>, PairIntersection>::iterator ci;
+    for (ci=intersectionCache.begin(); ci!=intersectionCache.end(); ++ci)
+        delete ci->second.mesh;
+    intersectionCache.clear();
 }
 
 void GlVisuals::simplifyObject(bool duplicate)
@@ -118,12 +176,83 @@ void GlVisuals::simplifyObject(bool duplicate)
         sel_i = model.size()-1;
     }
 
-    model.back()->simplify(9); // 9% so that we reach the limit of reduction for this step
+    model.back()->simplify(66); // Keep two thirds, a third less for each step
+    prepareVoxels();
+    prepareLod();
     intersectScene();
 }
 
+/**
+ * The voxels are scanned here, when they are turned on or a mesh is
+ * added, and not while drawing.
+ */
+void GlVisuals::prepareVoxels()
+{
+    if (!(style & VOXELS)) return;
+    for (int i=0; i<armadillo.size(); ++i) armadillo[i]->prepareVoxels();
+    for (int i=0; i<car.size(); ++i) car[i]->prepareVoxels();
+}
+
+/**
+ * Screen area in pixels that each triangle of a progressive mesh
+ * should cover, roughly. The area is that of the bounding sphere.
+ */
+static const float LOD_PIXELS_PER_TRIANGLE = 2;
+
+void GlVisuals::toggleLod()
+{
+    lod_mode = !lod_mode;
+    if (lod_mode) {
+        prepareLod();
+        return;
+    }
+    for (int i=0; i<armadillo.size(); ++i) armadillo[i]->clearProgressive();
+    for (int i=0; i<car.size(); ++i) car[i]->clearProgressive();
+}
+
+/**
+ * The progressive meshes are recorded here, when the mode is turned on
+ * or a mesh is edited, and not while drawing. Those already recorded
+ * are kept.
+ */
+void GlVisuals::prepareLod()
+{
+    if (!lod_mode) return;
+    for (int i=0; i<armadillo.size(); ++i)
+        if (!armadillo[i]->hasProgressive()) armadillo[i]->createProgressive();
+    for (int i=0; i<car.size(); ++i)
+        if (!car[i]->hasProgressive()) car[i]->createProgressive();
+}
+
+void GlVisuals::chooseLod(Mesh *mesh)
+{
+    if (!mesh->hasProgressive())
+        return;
+
+    /* Distance of the mesh from the eye, from the current modelview matrix */
+    GLfloat mv[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    Box box = mesh->getWorldBox();
+    Point c = Point(box.min).add(box.max).scale(0.5f);
+    float radius = Geom::distance(box.min, box.max)/2;
+    float dist = -(mv[2]*c.x + mv[6]*c.y + mv[10]*c.z + mv[14]);
+    if (!perspective_proj || dist <= radius) {
+        mesh->setLodTriangles(mesh->getTriangleCount());
+        return;
+    }
+
+    /* Radius on the screen, for the 60 degree field of view of glResize */
+    float pixels = radius*screen_height/(2*dist*tan(30*PI/180));
+    mesh->setLodTriangles((int)(PI*pixels*pixels/LOD_PIXELS_PER_TRIANGLE));
+}
+
 void GlVisuals::drawScene()
 {
+    if (lod_mode) {
+        for (int i=0; i<armadillo.size(); ++i) chooseLod(armadillo[i]);
+        for (int i=0; i<car.size(); ++i) chooseLod(car[i]);
+    }
+
     for (int i=0; i<armadillo.size(); ++i)
         armadillo[i]->draw (Colour(0x66,0x66,0), style | ((i==sel_i&&sel_obj==0)?bvlStyle:0));
 
@@ -185,6 +314,8 @@ void GlVisuals::glInitialize()
 
 void GlVisuals::glResize(int w, int h)
 {
+    screen_width = w;
+    screen_height = h;
     if(!perspective_proj) {
         int ww,hh;
         if (h==0) hh=1;
@@ -273,8 +404,9 @@ void GlVisuals::keyEvent (unsigned char key,  bool up, int x, int y, int modif)
         else if (key=='w') style ^= WIRE;
         else if (key=='n') style ^= NORMALS;
         else if (key=='t') style ^= TBOXES;
-        else if (key=='v') style ^= VOXELS;
+        else if (key=='v') { style ^= VOXELS; prepareVoxels(); }
         else if (key=='h') style ^= HIER;
+        else if (key=='l') toggleLod();
     }
 
 }
@@ -5,11 +5,22 @@
 #ifndef VISUALS_H
 #define VISUALS_H
 
+#include <map>
 #include "mesh.h"
 
 static const Point globRot0(30,180,0);
 static const Point globTrans0(0,0,0);
 
+/**
+ * The intersection of two scene meshes, kept until one of them changes
+ * or they move relative to each other.
+ */
+struct PairIntersection {
+    Transform rel;                      ///< Placement of the second mesh in the frame of the first
+    int version1, version2;             ///< Geometry versions of the meshes when intersected
+    Mesh *mesh;                         ///< The intersection, or NULL if it was empty
+};
+
 /**
  * Class that handles the scene and the user interface.
  */
@@ -27,6 +38,7 @@ class GlVisuals
     int screen_width, screen_height;    ///< Size of the windows in pixels
     int sel_i, sel_obj;                 ///< Selected objects
     int style, bvlStyle;                ///< The global style used for model drawing
+    bool lod_mode;                      ///< Draw progressive meshes, at a level chosen by their size on the screen
 
     /* For animation */
     float t;                            ///< Elapsed time in seconds since the start of the animation
@@ -39,7 +51,8 @@ class GlVisuals
     /* Scene objects */
     vector<Mesh*> armadillo;
     vector<Mesh*> car;
-    vector<Mesh*> intersection;
+    vector<Mesh*> intersection;         ///< The non empty intersections. Owned by intersectionCache.
+    map<pair<int,int>, PairIntersection> intersectionCache;    ///< Intersections by the ids of the two meshes
 
     /* Manipulation of scene */
     void drawAxes ();
@@ -47,7 +60,12 @@ class GlVisuals
     void drawScene ();
     void resetScene ();
     void intersectScene ();
+    void clearIntersections ();
     void simplifyObject (bool duplicate=false);
+    void toggleLod ();
+    void prepareLod ();
+    void prepareVoxels ();
+    void chooseLod (Mesh *mesh);
 
 public:
     GlVisuals();
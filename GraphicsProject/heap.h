@@ -0,0 +1,121 @@
+/** @file heap.h
+ * Definition of class IndexedHeap.
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * Binary min-heap of the keys 0..n-1, each with a cost.
+ *
+ * The position of every key in the heap is kept, so the cost of a
+ * queued key can be changed or the key removed in O(log n). Equal
+ * costs come out in the order of their keys, so results are repeatable.
+ */
+class IndexedHeap
+{
+    vector<int> mHeap;                          ///< The queued keys in heap order
+    vector<int> mPos;                           ///< Position of each key in mHeap, -1 if it is not queued
+    vector<float> mCost;                        ///< Cost of each key
+
+    bool less (int a, int b) const {
+        return mCost[a] < mCost[b] || (mCost[a] == mCost[b] && a < b);
+    }
+
+    void place (int i, int key) {
+        mHeap[i] = key;
+        mPos[key] = i;
+    }
+
+    void up (int i) {
+        int key = mHeap[i];
+        while (i > 0) {
+            int parent = (i-1)/2;
+            if (!less(key, mHeap[parent])) break;
+            place(i, mHeap[parent]);
+            i = parent;
+        }
+        place(i, key);
+    }
+
+    void down (int i) {
+        int key = mHeap[i];
+        int n = mHeap.size();
+        for (;;) {
+            int ch = 2*i+1;
+            if (ch >= n) break;
+            if (ch+1 < n && less(mHeap[ch+1], mHeap[ch])) ++ch;
+            if (!less(mHeap[ch], key)) break;
+            place(i, mHeap[ch]);
+            i = ch;
+        }
+        place(i, key);
+    }
+
+public:
+    IndexedHeap (int n=0):
+        mPos(n, -1),
+        mCost(n, 0)
+    {
+    }
+
+    /** Queues all the keys at once, in O(n). */
+    void build (const vector<float> &costs) {
+        int n = costs.size();
+        mCost = costs;
+        mPos.resize(n);
+        mHeap.resize(n);
+        for (int k=0; k<n; ++k)
+            place(k, k);
+        for (int i=n/2-1; i>=0; --i)
+            down(i);
+    }
+
+    /** Queues a key, or changes its cost if it is already queued. */
+    void push (int key, float cost) {
+        if (mPos[key] < 0) {
+            mCost[key] = cost;
+            mHeap.push_back(key);
+            up(mHeap.size()-1);
+        } else if (cost < mCost[key]) {
+            mCost[key] = cost;
+            up(mPos[key]);
+        } else {
+            mCost[key] = cost;
+            down(mPos[key]);
+        }
+    }
+
+    /** Removes a key from the queue, if it is there. */
+    void remove (int key) {
+        int i = mPos[key];
+        if (i < 0) return;
+        mPos[key] = -1;
+        int last = mHeap.back();
+        mHeap.pop_back();
+        if (last == key) return;
+        mHeap[i] = last;
+        mPos[last] = i;
+        up(i);
+        down(mPos[last]);
+    }
+
+    /** Removes and returns the key with the lowest cost. */
+    int pop () {
+        int key = mHeap[0];
+        remove(key);
+        return key;
+    }
+
+    int top () const { return mHeap[0]; }
+    float cost (int key) const { return mCost[key]; }
+    bool contains (int key) const { return mPos[key] >= 0; }
+    int size () const { return mHeap.size(); }
+    bool empty () const { return mHeap.empty(); }
+};
+
+#endif
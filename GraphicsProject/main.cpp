@@ -7,7 +7,9 @@
  */
 
 #include <cstdio>
+#include <cstring>
 #include "glvisuals.h"
+#include "bench.h"
 
 #ifdef __linux__
 #include <GL/glut.h>
@@ -111,6 +113,10 @@ void SpeciaEvent (int key, int x, int y)
 
 int main(int argc, char* argv[])
 {
+    /* Run the benchmarks instead of the application */
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+        return Bench::run(argc-2, argv+2);
+
     visuals = new GlVisuals();
 
     /* Init GLUT */
@@ -7,11 +7,16 @@
 #include <cfloat>
 #include <iostream>
 #include <vector>
-#include <list>
 #include <set>
 #include <algorithm>
 #include "mesh.h"
 #include "geom.h"
+#include "parallel.h"
+#include "heap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef __linux__
 #include <GL/glut.h>
@@ -19,39 +24,83 @@
 #include "gl/glut.h"
 #endif
 
-Mesh::Mesh(string filename, bool ccw):
+int Mesh::nextId = 0;
+
+/** Names of the hierarchy builders, in the order of BvhBuilder */
+static const char *builderNames[] = {"midpoint", "sah", "lbvh"};
+
+Mesh::Mesh():
+    mRot(0,0,0),
+    mPos(0,0,0),
+    mAABB(1),
+    mSphere(BVL_SIZE(BVL)),
+    mSphereOffsets(BVL_SIZE(BVL)+1, 0)
+{
+    mId = nextId++;
+    mVersion = 0;
+    mBvhCost = 0;
+    mLodLevel = 0;
+    mVoxelsReady = false;
+}
+
+Mesh::Mesh(string filename, bool ccw, const MeshOptions &opt):
     mRot(0,0,0),
     mPos(0,0,0),
-    mAABB(BVL_SIZE(BVL)),
-    mAABBTriangles(BVL_SIZE(BVL)),
+    mOpt(opt),
+    mAABB(1),
     mSphere(BVL_SIZE(BVL)),
-    mSphereTriangles(BVL_SIZE(BVL))
+    mSphereOffsets(BVL_SIZE(BVL)+1, 0)
 {
+    mId = nextId++;
+    mVersion = 0;
+    mLodLevel = 0;
+    mVoxelsReady = false;
     clock_t t = clock();
-    loadObj(filename, mVertices, mTriangles, ccw);
-    createTriangleLists();
-    createBoundingVolHierarchy();
-    centerAlign();
-    createNormals();
-    calculateVolume();
-    printf ("Mesh loading took:\t%4.2f sec | %d triangles \n", ((float)clock()-t)/CLOCKS_PER_SEC, mTriangles.size());
+    string cachename = filename + ".cache";
+    unsigned long long key = cacheKey(filename, ccw, mOpt);
+
+    if (readCache(cachename, key)) {
+        createTriangleLists();
+        fitNodeSpheres();
+        mBvhCost = getBvhStats().sahCost;
+        printf ("Mesh cache loading took:\t%4.2f sec | %d triangles \n", ((float)clock()-t)/CLOCKS_PER_SEC, (int)mTriangles.size());
+    } else {
+        loadObj(filename, mVertices, mTriangles, ccw);
+        createTriangleLists();
+        createBoundingVolHierarchy();
+        centerAlign();
+        createNormals();
+        calculateVolume();
+        writeCache(cachename, key);
+        printf ("Mesh loading took:\t%4.2f sec | %d triangles \n", ((float)clock()-t)/CLOCKS_PER_SEC, (int)mTriangles.size());
+    }
+    BvhStats st = getBvhStats();
     for (int blevel=0; blevel<=BVL; blevel++)
-        printf("Coverage Level %d: AABB %4.2f%%, Sphere %4.2f%% \n", blevel, 100*AABBCover[blevel], 100*sphereCover[blevel]);
+        printf("Coverage Level %d: AABB %4.2f%%, Sphere %4.2f%% | duplication %.2f \n",
+               blevel, 100*AABBCover[blevel], 100*sphereCover[blevel], st.levelDuplication[blevel]);
 
+    printf("Box hierarchy (%s): SAH cost %.1f | %.1f triangles per leaf | duplication %.2f \n",
+           builderNames[mOpt.bvhBuilder], st.sahCost, st.avgLeafSize, st.duplication);
 }
 
-Mesh::Mesh( Mesh &m1,  Mesh &m2, bool both):
-    mRot(0,0,0),
-    mPos(0,0,0),
-    mAABB(BVL_SIZE(BVL)),
-    mAABBTriangles(BVL_SIZE(BVL)),
+Mesh::Mesh(const Mesh &m1, const Mesh &m2, bool both, CollisionMode mode):
+    mRot(m1.mRot),
+    mPos(m1.mPos),
+    mAABB(1),
     mSphere(BVL_SIZE(BVL)),
-    mSphereTriangles(BVL_SIZE(BVL))
+    mSphereOffsets(BVL_SIZE(BVL)+1, 0)
 {
+    mId = nextId++;
+    mVersion = 0;
+    mBvhCost = 0;
+    mLodLevel = 0;
+    mVoxelsReady = false;
     clock_t t = clock();
-    intersect(m1, m2, mVertices, mTriangles, both);
+    intersect(m1, m2, mVertices, mTriangles, both, &mCollisionStats, mode);
     if ( mTriangles.size())
-        printf ("Mesh intersection took:\t%4.2f sec | %d triangles \n", ((float)clock()-t)/CLOCKS_PER_SEC, mTriangles.size());
+        printf ("Mesh intersection took:\t%4.2f sec | %d triangles | %lu node pairs | %lu triangle pairs \n",
+                ((float)clock()-t)/CLOCKS_PER_SEC, (int)mTriangles.size(),
+                mCollisionStats.nodePairs, mCollisionStats.trianglePairs);
 }
 
 Mesh::Mesh(const Mesh &copyfrom):
@@ -59,13 +108,25 @@ Mesh::Mesh(const Mesh &copyfrom):
     mTriangles (copyfrom.mTriangles),
     mVertexNormals (copyfrom.mVertexNormals),
     mVertexTriangles (copyfrom.mVertexTriangles),
-    mAABBTriangles (copyfrom.mAABBTriangles),
     mSphere(copyfrom.mSphere),
-    mSphereTriangles(copyfrom.mSphereTriangles),
+    mSphereOffsets(copyfrom.mSphereOffsets),
+    mSphereIndices(copyfrom.mSphereIndices),
     mAABB (copyfrom.mAABB),
+    mAABBIndices (copyfrom.mAABBIndices),
+    mNodeSpheres (copyfrom.mNodeSpheres),
     mRot (copyfrom.mRot),
-    mPos (copyfrom.mPos)
+    mPos (copyfrom.mPos),
+    mOpt (copyfrom.mOpt),
+    mBvhCost (copyfrom.mBvhCost),
+    mSplits (copyfrom.mSplits),
+    mSplitCorners (copyfrom.mSplitCorners),
+    mLodIndices (copyfrom.mLodIndices),
+    mLodVertices (copyfrom.mLodVertices),
+    mLodLevel (copyfrom.mLodLevel)
 {
+    mId = nextId++;
+    mVersion = 0;
+    mVoxelsReady = false;
     vector<Triangle>::iterator ti;
     for (ti=mTriangles.begin(); ti!= mTriangles.end(); ++ti)
         ti->vecList = &mVertices;
@@ -78,16 +139,7 @@ Mesh::~Mesh()
 
 void Mesh::createTriangleLists()
 {
-    mVertexTriangles.clear();
-    mVertexTriangles.resize(mVertices.size());
-
-    int i=0;
-    vector<Triangle>::iterator ti;
-    for (ti=mTriangles.begin(); ti!= mTriangles.end(); ++ti) {
-        mVertexTriangles[ti->vi1].insert(i);
-        mVertexTriangles[ti->vi2].insert(i);
-        mVertexTriangles[ti->vi3].insert(i++);
-    }
+    mVertexTriangles.build(mVertices.size(), mTriangles);
 }
 
 void Mesh::createNormals()
@@ -97,8 +149,8 @@ void Mesh::createNormals()
     Point normSum;
     for (int vi=0; vi< mVertices.size(); ++vi) {
         normSum.x=0; normSum.y=0; normSum.z=0;
-        set<int>::const_iterator _ti;
-        for (_ti=mVertexTriangles[vi].begin(); _ti!=mVertexTriangles[vi].end(); ++_ti)
+        const int *_ti;
+        for (_ti=mVertexTriangles.begin(vi); _ti!=mVertexTriangles.end(vi); ++_ti)
             normSum.add(mTriangles[*_ti].getNormal());
         mVertexNormals[vi] = normSum.scale(1.0f/3);
     }
@@ -113,100 +165,789 @@ void Mesh::updateTriangleData()
 
 void Mesh::createBoundingVolHierarchy()
 {
-    createBoundingBoxHierarchy();
-    createBoundingSphereHierarchy();
+    /* The two hierarchies only read the triangles, so they are built at the same time */
+    Parallel::run(2, [this](int i) {
+        if (i==0) createBoundingBoxHierarchy();
+        else createBoundingSphereHierarchy();
+    });
+}
+
+/**
+ * Nodes with at least this many triangles are split with all the threads.
+ * The subtrees of smaller nodes are built as separate tasks.
+ */
+static const int PARALLEL_SPLIT = 4096;
+
+/**
+ * Number of chunks to divide the triangles of a node into, one per thread
+ * for the large nodes.
+ */
+static int splitChunks(int n)
+{
+    return n >= PARALLEL_SPLIT ? Parallel::threadCount() : 1;
+}
+
+/**
+ * Joins the triangle lists of the chunks in order. The result is the
+ * same as that of a single chunk.
+ */
+static void joinChunks(vector<vector<int> > &chunks, vector<int> &out)
+{
+    if (chunks.size() == 1) {
+        out.swap(chunks[0]);
+        return;
+    }
+    out.clear();
+    for (int c=0; c<chunks.size(); ++c)
+        out.insert(out.end(), chunks[c].begin(), chunks[c].end());
 }
 
 void Mesh::createBoundingBoxHierarchy()
 {
+    if (mOpt.bvhBuilder == BVH_LBVH) {
+        createMortonHierarchy();
+        fitNodeSpheres();
+        mBvhCost = getBvhStats().sahCost;
+        return;
+    }
+
     /* The main box */
-    mAABB[0] = Box(mVertices);
+    mAABB.assign(1, BvhNode());
+    mAABB[0].box = Box(mVertices);
 
-    /*Construct a triangle list with all the triangles */
-    mAABBTriangles[0].clear();
+    /* The triangles of every node while the hierarchy is built */
+    vector<vector<int> > tris(1);
     for (int ti=0; ti < mTriangles.size(); ++ti)
-        mAABBTriangles[0].push_back(ti);
+        tris[0].push_back(ti);
+
+    /* Split the large nodes first, each one with all the threads */
+    vector<pair<int,int> > stack(1, make_pair(0, 0)), pending;
+    splitNodes(mAABB, tris, stack, PARALLEL_SPLIT, &pending);
+
+    /* Then build the subtree of every remaining node as a task of its own */
+    vector<vector<BvhNode> > subNodes(pending.size());
+    vector<vector<vector<int> > > subTris(pending.size());
+    Parallel::steal(pending.size(), [&](int i) {
+        int root = pending[i].first;
+        vector<pair<int,int> > stack(1, make_pair(0, pending[i].second));
+        subNodes[i].assign(1, mAABB[root]);
+        subTris[i].resize(1);
+        subTris[i][0].swap(tris[root]);
+        splitNodes(subNodes[i], subTris[i], stack, 0, NULL);
+    });
+
+    /* Append the subtrees. Their roots are already in place. */
+    for (int i=0; i<pending.size(); ++i) {
+        int root = pending[i].first;
+        int offset = (int)mAABB.size()-1;
+        vector<BvhNode> &nodes = subNodes[i];
+        for (int bi=0; bi<nodes.size(); ++bi) {
+            if (!nodes[bi].isLeaf()) nodes[bi].index += offset;
+        }
+        mAABB[root] = nodes[0];
+        tris[root].swap(subTris[i][0]);
+        mAABB.insert(mAABB.end(), nodes.begin()+1, nodes.end());
+        for (int bi=1; bi<nodes.size(); ++bi) {
+            tris.push_back(vector<int>());
+            tris.back().swap(subTris[i][bi]);
+        }
+        vector<BvhNode>().swap(nodes);
+    }
 
-    /* For every level of hierarchy... */
-    for (int bvlevel=0; bvlevel<BVL; ++bvlevel) {
-	/* ...divide every box of that level. */
-        for (int div=0; div < (1<<bvlevel); ++div) {
-            /* Find parent's, children's indices */
-            int parent = (1<<bvlevel) -1+div;
-            int chL = 2*parent+1;
-            int chR = 2*parent+2;
-            mAABBTriangles[chL].clear();
-            mAABBTriangles[chR].clear();
-            /* Find the largest of the 3 dimensions (xyz) and divide the box */
-            Point &min = mAABB[parent].min;
-            Point &max = mAABB[parent].max;
-            int dim=0;
-            Box boxL, boxR;
-            if (mAABB[parent].getXSize() > mAABB[parent].getYSize())
-                dim = (mAABB[parent].getXSize() > mAABB[parent].getZSize())? 0 : 1;
-            else dim = (mAABB[parent].getYSize() > mAABB[parent].getZSize())? 1 : 2;
-            float lim = (max.data[dim] + min.data[dim])/2;
-            if (dim==0) {
-                boxL = Box(min, Point(lim, max.y, max.z));
-                boxR = Box(Point(lim, min.y, min.z), max);
-            } else if (dim==1) {
-                boxL = Box(min, Point(max.x, lim, max.z));
-                boxR = Box(Point(min.x, lim, min.z), max);
+    /* Number the nodes in the order that a single depth first pass would
+     * create them, so that the result does not depend on the tasks */
+    vector<BvhNode> nodes(1, mAABB[0]);
+    vector<vector<int> > leafTris(1);
+    leafTris[0].swap(tris[0]);
+    vector<int> order(1, 0);
+    while (!order.empty()) {
+        int bi = order.back();
+        order.pop_back();
+        if (nodes[bi].isLeaf()) continue;
+
+        int chOld = nodes[bi].index;
+        int ch = nodes.size();
+        nodes[bi].index = ch;
+        for (int k=0; k<2; ++k) {
+            nodes.push_back(mAABB[chOld+k]);
+            leafTris.push_back(vector<int>());
+            leafTris.back().swap(tris[chOld+k]);
+        }
+        order.push_back(ch+1);
+        order.push_back(ch);
+    }
+    mAABB.swap(nodes);
+
+    /* Lay out the triangles of the leaves one after the other */
+    mAABBIndices.clear();
+    for (int bi=0; bi<mAABB.size(); ++bi) {
+        BvhNode &node = mAABB[bi];
+        if (node.index) continue;
+        node.count = leafTris[bi].size();
+        node.index = node.count ? mAABBIndices.size() : 0;
+        mAABBIndices.insert(mAABBIndices.end(), leafTris[bi].begin(), leafTris[bi].end());
+    }
+    fitNodeSpheres();
+    mBvhCost = getBvhStats().sahCost;
+}
+
+void Mesh::fitNodeSpheres()
+{
+    /* From the leaves up. Children always come after their parent. */
+    vector<int> mark(mVertices.size(), -1), verts;
+    mNodeSpheres.resize(mAABB.size());
+    for (int bi=mAABB.size()-1; bi>=0; --bi) {
+        const BvhNode &node = mAABB[bi];
+        Sphere &s = mNodeSpheres[bi];
+        if (node.isLeaf()) {
+            verts.clear();
+            for (int i=node.index; i<node.index+node.count; ++i) {
+                const Triangle &t = mTriangles[mAABBIndices[i]];
+                for (int k=0; k<3; ++k) {
+                    if (mark[t.v[k]] == bi) continue;
+                    mark[t.v[k]] = bi;
+                    verts.push_back(t.v[k]);
+                }
+            }
+            s = Geom::enclosingSphere(mVertices, verts);
+            continue;
+        }
+
+        /* Enclose the children that hold anything. The sphere
+         * around the box of the node may be smaller. */
+        int ch = node.index;
+        bool emptyL = mAABB[ch].box.isEmpty(), emptyR = mAABB[ch+1].box.isEmpty();
+        if (emptyL && emptyR) {
+            s = Sphere();
+            continue;
+        }
+        s = emptyL ? mNodeSpheres[ch+1] : mNodeSpheres[ch];
+        if (!emptyL && !emptyR) s.extend(mNodeSpheres[ch+1]);
+        const Box &b = node.box;
+        Sphere around(Point(b.min).add(b.max).scale(0.5f), Geom::distance(b.min, b.max)/2);
+        if (around.rad < s.rad) s = around;
+    }
+}
+
+/**
+ * Meshes with more triangles than this get 63 bit Morton codes instead of 30 bit ones.
+ */
+static const int MORTON_WIDE = 1<<20;
+
+/**
+ * Spreads the lowest 21 bits of x so that two zero bits follow each of them.
+ */
+static unsigned long long spreadBits(unsigned long long x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2)  & 0x1249249249249249ULL;
+    return x;
+}
+
+/**
+ * Interleaves the coordinates of a point, given in [0,1] of the
+ * bounds, into a Morton code of 3*bits bits.
+ */
+static unsigned long long mortonCode(float x, float y, float z, int bits)
+{
+    float scale = (float)((1<<bits)-1);
+    unsigned long long ix = (unsigned long long)(std::min(std::max(x, 0.0f), 1.0f)*scale);
+    unsigned long long iy = (unsigned long long)(std::min(std::max(y, 0.0f), 1.0f)*scale);
+    unsigned long long iz = (unsigned long long)(std::min(std::max(z, 0.0f), 1.0f)*scale);
+    return spreadBits(ix)<<2 | spreadBits(iy)<<1 | spreadBits(iz);
+}
+
+/**
+ * Sorts the values by their keys, looking at the lowest bits of the keys
+ * only. Each pass sorts by 8 bits. The chunks of every pass count and
+ * move their part of the keys on their own thread. Equal keys keep their
+ * order, so the result does not depend on the number of threads.
+ */
+static void radixSort(vector<unsigned long long> &keys, vector<int> &values, int bits)
+{
+    const int RADIX = 256;
+    int n = keys.size();
+    int nc = splitChunks(n);
+    vector<unsigned long long> keysOut(n);
+    vector<int> valuesOut(n);
+    vector<int> offsets(nc*RADIX);
+
+    for (int shift=0; shift<bits; shift+=8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        Parallel::run(nc, [&](int c) {
+            int *count = &offsets[c*RADIX];
+            int end = (long long)n*(c+1)/nc;
+            for (int i = (long long)n*c/nc; i<end; ++i)
+                ++count[(keys[i]>>shift) & (RADIX-1)];
+        });
+
+        /* Every chunk writes each digit after the earlier chunks */
+        int sum = 0;
+        for (int d=0; d<RADIX; ++d) {
+            for (int c=0; c<nc; ++c) {
+                int count = offsets[c*RADIX+d];
+                offsets[c*RADIX+d] = sum;
+                sum += count;
+            }
+        }
+
+        Parallel::run(nc, [&](int c) {
+            int *next = &offsets[c*RADIX];
+            int end = (long long)n*(c+1)/nc;
+            for (int i = (long long)n*c/nc; i<end; ++i) {
+                int at = next[(keys[i]>>shift) & (RADIX-1)]++;
+                keysOut[at] = keys[i];
+                valuesOut[at] = values[i];
+            }
+        });
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}
+
+/**
+ * Finds where a range of sorted Morton codes changes at its highest
+ * differing bit. Ranges of equal codes are split in the middle.
+ */
+static int mortonSplit(const vector<unsigned long long> &codes, int begin, int end)
+{
+    unsigned long long diff = codes[begin] ^ codes[end-1];
+    if (!diff) return (begin+end)/2;
+
+    int bit = 63;
+    while (!(diff>>bit)) --bit;
+    unsigned long long mask = 1ULL<<bit;
+
+    /* The first code with that bit set. All codes of the range agree above it. */
+    int lo = begin, hi = end-1;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (codes[mid] & mask) hi = mid;
+        else lo = mid+1;
+    }
+    return lo;
+}
+
+void Mesh::createMortonHierarchy()
+{
+    int n = mTriangles.size();
+    int nc = splitChunks(n);
+    int bits = n > MORTON_WIDE ? 21 : 10;
+
+    /* Bounds of the centres of the triangle boxes */
+    vector<Box> chunkCentres(nc, Box::empty());
+    Parallel::run(nc, [&](int c) {
+        int end = (long long)n*(c+1)/nc;
+        for (int ti = (long long)n*c/nc; ti<end; ++ti) {
+            const Box &tb = mTriangles[ti].getBox();
+            Point centre = Point(tb.min).add(tb.max).scale(0.5f);
+            chunkCentres[c].extend(Box(centre, centre));
+        }
+    });
+    Box cb = Box::empty();
+    for (int c=0; c<nc; ++c)
+        cb.extend(chunkCentres[c]);
+
+    /* Sort the triangles by the Morton code of their centres. The grid is
+     * a cube, so that flat meshes are not split across their thin side. */
+    vector<unsigned long long> codes(n);
+    mAABBIndices.resize(n);
+    float size = std::max(cb.getXSize(), std::max(cb.getYSize(), cb.getZSize()));
+    float scale = size > 0 ? 1/size : 0;
+    Parallel::run(nc, [&](int c) {
+        int end = (long long)n*(c+1)/nc;
+        for (int ti = (long long)n*c/nc; ti<end; ++ti) {
+            const Box &tb = mTriangles[ti].getBox();
+            Point centre = Point(tb.min).add(tb.max).scale(0.5f);
+            codes[ti] = mortonCode((centre.x-cb.min.x)*scale, (centre.y-cb.min.y)*scale,
+                                   (centre.z-cb.min.z)*scale, bits);
+            mAABBIndices[ti] = ti;
+        }
+    });
+    radixSort(codes, mAABBIndices, 3*bits);
+
+    /* Split the sorted ranges depth first, like the other builders.
+     * The leaves point straight into the sorted triangles. */
+    mAABB.assign(1, BvhNode());
+    vector<pair<int,int> > ranges(1, make_pair(0, n));
+    vector<pair<int,int> > stack(1, make_pair(0, 0));
+    while (!stack.empty()) {
+        int parent = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+
+        int begin = ranges[parent].first, end = ranges[parent].second;
+        if (depth >= mOpt.maxDepth || end-begin <= mOpt.leafSize) {
+            mAABB[parent].count = end-begin;
+            mAABB[parent].index = end>begin ? begin : 0;
+            continue;
+        }
+
+        int split = mortonSplit(codes, begin, end);
+        int chL = mAABB.size();
+        mAABB.resize(chL+2);
+        ranges.push_back(make_pair(begin, split));
+        ranges.push_back(make_pair(split, end));
+        mAABB[parent].index = chL;
+        stack.push_back(make_pair(chL+1, depth+1));
+        stack.push_back(make_pair(chL, depth+1));
+    }
+
+    /* The nodes are numbered like those of the other builders, but the
+     * leaves point into the sorted triangles in depth first order. Lay
+     * them out in node order, like the other builders do. */
+    vector<int> indices;
+    indices.reserve(n);
+    for (int bi=0; bi<mAABB.size(); ++bi) {
+        BvhNode &node = mAABB[bi];
+        if (!node.isLeaf() || !node.count) continue;
+        int begin = indices.size();
+        indices.insert(indices.end(), mAABBIndices.begin()+node.index, mAABBIndices.begin()+node.index+node.count);
+        node.index = begin;
+    }
+    mAABBIndices.swap(indices);
+
+    /* Fit the boxes of the leaves, then those of the inner nodes from the bottom up */
+    int nodes = mAABB.size();
+    int nn = splitChunks(nodes);
+    Parallel::run(nn, [&](int c) {
+        int end = (long long)nodes*(c+1)/nn;
+        for (int bi = (long long)nodes*c/nn; bi<end; ++bi) {
+            BvhNode &node = mAABB[bi];
+            if (!node.isLeaf()) continue;
+            node.box = Box::empty();
+            for (int i=node.index; i<node.index+node.count; ++i)
+                node.box.extend(mTriangles[mAABBIndices[i]].getBox());
+        }
+    });
+    for (int bi=nodes-1; bi>=0; --bi) {
+        BvhNode &node = mAABB[bi];
+        if (node.isLeaf()) continue;
+        node.box = mAABB[node.index].box;
+        node.box.extend(mAABB[node.index+1].box);
+    }
+
+    /* The main box holds every vertex, as with the other builders */
+    mAABB[0].box = Box(mVertices);
+}
+
+void Mesh::splitNodes(vector<BvhNode> &nodes, vector<vector<int> > &tris,
+                      vector<pair<int,int> > &stack, int minSplit, vector<pair<int,int> > *pending) const
+{
+    /* Split the nodes depth first, until they are small enough or too deep.
+     * The two children of a node are always next to each other. */
+    while (!stack.empty()) {
+        int parent = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+
+        int n = tris[parent].size();
+        if (depth >= mOpt.maxDepth || n <= mOpt.leafSize) continue;
+        if (n < minSplit) {
+            pending->push_back(make_pair(parent, depth));
+            continue;
+        }
+
+        vector<int> left, right;
+        Box boxL, boxR;
+        if (mOpt.bvhBuilder == BVH_SAH) splitSAH(nodes[parent].box, tris[parent], left, right, boxL, boxR);
+        else splitMidpoint(nodes[parent].box, tris[parent], left, right, boxL, boxR);
+
+        /* Keep the node as a leaf if neither child got fewer triangles */
+        int nL = left.size(), nR = right.size();
+        if ((nL==n || nL==0) && (nR==n || nR==0)) continue;
+
+        int chL = nodes.size();
+        nodes.resize(chL+2);
+        tris.resize(chL+2);
+        nodes[chL].box = boxL;
+        nodes[chL+1].box = boxR;
+        tris[chL].swap(left);
+        tris[chL+1].swap(right);
+
+        nodes[parent].index = chL;
+        vector<int>().swap(tris[parent]);
+        stack.push_back(make_pair(chL+1, depth+1));
+        stack.push_back(make_pair(chL, depth+1));
+    }
+}
+
+void Mesh::boxDepths(vector<int> &depth) const
+{
+    /* Children always come after their parent */
+    depth.assign(mAABB.size(), 0);
+    for (int bi=0; bi<mAABB.size(); ++bi) {
+        if (!mAABB[bi].isLeaf()) {
+            depth[mAABB[bi].index] = depth[bi]+1;
+            depth[mAABB[bi].index+1] = depth[bi]+1;
+        }
+    }
+}
+
+void Mesh::splitMidpoint(const Box &box, const vector<int> &in, vector<int> &left, vector<int> &right,
+                         Box &boxL, Box &boxR) const
+{
+    /* Find the largest of the 3 dimensions (xyz) and divide the box */
+    const Point &min = box.min;
+    const Point &max = box.max;
+    int dim=0;
+    Box halfL, halfR;
+    if (box.getXSize() > box.getYSize())
+        dim = (box.getXSize() > box.getZSize())? 0 : 1;
+    else dim = (box.getYSize() > box.getZSize())? 1 : 2;
+    float lim = (max.data[dim] + min.data[dim])/2;
+    if (dim==0) {
+        halfL = Box(min, Point(lim, max.y, max.z));
+        halfR = Box(Point(lim, min.y, min.z), max);
+    } else if (dim==1) {
+        halfL = Box(min, Point(max.x, lim, max.z));
+        halfR = Box(Point(min.x, lim, min.z), max);
+    } else {
+        halfL = Box(min, Point(max.x, max.y, lim));
+        halfR = Box(Point(min.x, min.y, lim), max);
+    }
+
+    /* Find the triangles that belong to each subdivision, one chunk per thread */
+    int nc = splitChunks(in.size());
+    vector<vector<int> > chunkL(nc), chunkR(nc);
+    vector<Box> chunkBoxL(nc, Box::empty()), chunkBoxR(nc, Box::empty());
+    Parallel::run(nc, [&](int c) {
+        int end = (long long)in.size()*(c+1)/nc;
+        for (int i = (long long)in.size()*c/nc; i<end; ++i) {
+            const Triangle &t = mTriangles[in[i]];
+            /* Check both boxes. The exact test can only drop triangles,
+             * and a triangle that it drops from both keeps the box test. */
+            bool inL = Geom::touches(halfL, t.getBox());
+            bool inR = Geom::touches(halfR, t.getBox());
+            if (mOpt.exactSplit) {
+                bool exactL = inL && Geom::touches(halfL, t);
+                bool exactR = inR && Geom::touches(halfR, t);
+                if (exactL || exactR) {
+                    inL = exactL;
+                    inR = exactR;
+                }
+            }
+            if (inL) {
+                chunkL[c].push_back(in[i]);
+                for (int vi=0; vi<3; ++vi)
+                    chunkBoxL[c].extend(Box(mVertices[t.v[vi]], mVertices[t.v[vi]]));
+            }
+            if (inR) {
+                chunkR[c].push_back(in[i]);
+                for (int vi=0; vi<3; ++vi)
+                    chunkBoxR[c].extend(Box(mVertices[t.v[vi]], mVertices[t.v[vi]]));
+            }
+        }
+    });
+
+    joinChunks(chunkL, left);
+    joinChunks(chunkR, right);
+    boxL = Box::empty();
+    boxR = Box::empty();
+    for (int c=0; c<nc; ++c) {
+        boxL.extend(chunkBoxL[c]);
+        boxR.extend(chunkBoxR[c]);
+    }
+    boxL.cropBox(halfL);
+    boxR.cropBox(halfR);
+}
+
+/** Number of bins that the SAH builder tries to split between, per axis. */
+static const int SAH_BINS = 16;
+
+/** The bins of the SAH builder for every axis. */
+struct SahBins {
+    Box bins[3][SAH_BINS];
+    int counts[3][SAH_BINS];
+};
+
+void Mesh::splitSAH(const Box &box, const vector<int> &in, vector<int> &left, vector<int> &right,
+                    Box &boxL, Box &boxR) const
+{
+    int nc = splitChunks(in.size());
+
+    /* Bin the triangles by the centre of their boxes. Each chunk of
+     * triangles fills its own bins, which are then merged. */
+    vector<Box> chunkCentres(nc, Box::empty());
+    Parallel::run(nc, [&](int c) {
+        int end = (long long)in.size()*(c+1)/nc;
+        for (int i = (long long)in.size()*c/nc; i<end; ++i) {
+            const Box &tb = mTriangles[in[i]].getBox();
+            Point centre = Point(tb.min).add(tb.max).scale(0.5f);
+            chunkCentres[c].extend(Box(centre, centre));
+        }
+    });
+    Box cb = Box::empty();
+    for (int c=0; c<nc; ++c)
+        cb.extend(chunkCentres[c]);
+
+    float lo[3], ext[3];
+    for (int dim=0; dim<3; ++dim) {
+        lo[dim] = cb.min.data[dim];
+        ext[dim] = cb.max.data[dim] - lo[dim];
+    }
+
+    vector<SahBins> chunkBins(nc);
+    Parallel::run(nc, [&](int c) {
+        SahBins &sb = chunkBins[c];
+        for (int dim=0; dim<3; ++dim) {
+            for (int b=0; b<SAH_BINS; ++b) {
+                sb.bins[dim][b] = Box::empty();
+                sb.counts[dim][b] = 0;
+            }
+        }
+        int end = (long long)in.size()*(c+1)/nc;
+        for (int i = (long long)in.size()*c/nc; i<end; ++i) {
+            const Box &tb = mTriangles[in[i]].getBox();
+            for (int dim=0; dim<3; ++dim) {
+                if (!(ext[dim] > 0)) continue;
+                float centre = 0.5f*(tb.min.data[dim] + tb.max.data[dim]);
+                int b = std::min(SAH_BINS-1, (int)(SAH_BINS*(centre-lo[dim])/ext[dim]));
+                sb.bins[dim][b].extend(tb);
+                ++sb.counts[dim][b];
+            }
+        }
+    });
+
+    /* Find the plane between two bins with the lowest cost on any axis */
+    int bestDim = -1, bestSplit = 0;
+    float bestCost = FLT_MAX;
+    for (int dim=0; dim<3 && in.size()>1; ++dim) {
+        if (!(ext[dim] > 0)) continue;
+
+        Box bins[SAH_BINS];
+        int counts[SAH_BINS];
+        for (int b=0; b<SAH_BINS; ++b) {
+            bins[b] = Box::empty();
+            counts[b] = 0;
+            for (int c=0; c<nc; ++c) {
+                bins[b].extend(chunkBins[c].bins[dim][b]);
+                counts[b] += chunkBins[c].counts[dim][b];
+            }
+        }
+
+        float areaR[SAH_BINS];
+        int countR[SAH_BINS];
+        Box acc = Box::empty();
+        int n = 0;
+        for (int b=SAH_BINS-1; b>0; --b) {
+            acc.extend(bins[b]);
+            n += counts[b];
+            areaR[b] = acc.getSurfaceArea();
+            countR[b] = n;
+        }
+        acc = Box::empty();
+        n = 0;
+        for (int b=1; b<SAH_BINS; ++b) {
+            acc.extend(bins[b-1]);
+            n += counts[b-1];
+            if (!n || !countR[b]) continue;
+            float cost = acc.getSurfaceArea()*n + areaR[b]*countR[b];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestDim = dim;
+                bestSplit = b;
+            }
+        }
+    }
+
+    /* Nothing to split. Everything goes to the left child. */
+    if (bestDim < 0) {
+        left = in;
+        right.clear();
+        boxL = in.empty() ? Box::empty() : box;
+        boxR = Box::empty();
+        return;
+    }
+
+    /* Divide the triangles at the chosen plane, one chunk per thread */
+    vector<vector<int> > chunkL(nc), chunkR(nc);
+    vector<Box> chunkBoxL(nc, Box::empty()), chunkBoxR(nc, Box::empty());
+    Parallel::run(nc, [&](int c) {
+        int end = (long long)in.size()*(c+1)/nc;
+        for (int i = (long long)in.size()*c/nc; i<end; ++i) {
+            const Box &tb = mTriangles[in[i]].getBox();
+            float centre = 0.5f*(tb.min.data[bestDim] + tb.max.data[bestDim]);
+            int b = std::min(SAH_BINS-1, (int)(SAH_BINS*(centre-lo[bestDim])/ext[bestDim]));
+            if (b < bestSplit) {
+                chunkL[c].push_back(in[i]);
+                chunkBoxL[c].extend(tb);
             } else {
-                boxL = Box(min, Point(max.x, max.y, lim));
-                boxR = Box(Point(min.x, min.y, lim), max);
-            }
-            /* Find the triangles that belong to each subdivision*/
-            Point minL,maxL,minR,maxR;
-            minL.x = minL.y = minL.z = FLT_MAX;
-            maxL.x = maxL.y = maxL.z = FLT_MIN;
-            minR.x = minR.y = minR.z = FLT_MAX;
-            maxR.x = maxR.y = maxR.z = FLT_MIN;
-
-            list<int>::const_iterator bvi;
-            for (bvi=mAABBTriangles[parent].begin(); bvi!=mAABBTriangles[parent].end(); ++bvi) {
-                Triangle &t = mTriangles[*bvi];
-                /* Check both boxes */
-                if (Geom::intersects(boxL, t.getBox())) {
-                    mAABBTriangles[chL].push_back(*bvi);
-                    for (int vi=0; vi<3; ++vi) {
-                        Point &v = mVertices[t.v[vi]];
-                        if      (v.x > maxL.x) maxL.x = v.x;
-                        else if (v.x < minL.x) minL.x = v.x;
-                        if      (v.y > maxL.y) maxL.y = v.y;
-                        else if (v.y < minL.y) minL.y = v.y;
-                        if      (v.z > maxL.z) maxL.z = v.z;
-                        else if (v.z < minL.z) minL.z = v.z;
-                    }
+                chunkR[c].push_back(in[i]);
+                chunkBoxR[c].extend(tb);
+            }
+        }
+    });
+
+    joinChunks(chunkL, left);
+    joinChunks(chunkR, right);
+    boxL = Box::empty();
+    boxR = Box::empty();
+    for (int c=0; c<nc; ++c) {
+        boxL.extend(chunkBoxL[c]);
+        boxR.extend(chunkBoxR[c]);
+    }
+}
+
+void Mesh::refitBoundingVolHierarchy(const vector<int> &newIndex)
+{
+    /* Renumber the triangles of the leaves and drop the deleted ones.
+     * They go to a new array, so the order of the leaf ranges does not matter. */
+    vector<int> indices;
+    indices.reserve(mAABBIndices.size());
+    for (int bi=0; bi<mAABB.size(); ++bi) {
+        BvhNode &node = mAABB[bi];
+        if (!node.isLeaf()) continue;
+        int begin = indices.size();
+        for (int i=node.index; i<node.index+node.count; ++i) {
+            int ti = newIndex[mAABBIndices[i]];
+            if (ti >= 0) indices.push_back(ti);
+        }
+        node.count = indices.size()-begin;
+        node.index = node.count ? begin : 0;
+    }
+    mAABBIndices.swap(indices);
+
+    /* Fit the boxes from the leaves up. Children always come after their parent. */
+    for (int bi=mAABB.size()-1; bi>=0; --bi) {
+        BvhNode &node = mAABB[bi];
+        node.box = Box::empty();
+        if (node.isLeaf()) {
+            for (int i=node.index; i<node.index+node.count; ++i)
+                node.box.extend(mTriangles[mAABBIndices[i]].getBox());
+        } else {
+            node.box.extend(mAABB[node.index].box);
+            node.box.extend(mAABB[node.index+1].box);
+        }
+    }
+
+    fitNodeSpheres();
+
+    /* Same for the spheres. The leaves are fitted to their vertices
+     * and every other sphere encloses its two children. */
+    int out = 0;
+    for (int si=0; si<BVL_SIZE(BVL); ++si) {
+        int begin = mSphereOffsets[si], end = mSphereOffsets[si+1];
+        mSphereOffsets[si] = out;
+        for (int i=begin; i<end; ++i) {
+            int ti = newIndex[mSphereIndices[i]];
+            if (ti >= 0) mSphereIndices[out++] = ti;
+        }
+    }
+    mSphereOffsets[BVL_SIZE(BVL)] = out;
+    mSphereIndices.resize(out);
+
+    vector<int> mark(mVertices.size(), -1), verts;
+    for (int si=BVL_SIZE(BVL)-1; si>=0; --si) {
+        int chL = 2*si+1, chR = 2*si+2;
+        int count = mSphereOffsets[si+1]-mSphereOffsets[si];
+        if (!count) {
+            mSphere[si] = Sphere();
+        } else if (chL >= BVL_SIZE(BVL)) {
+            mSphere[si] = fitSphere(mSphereIndices.data()+mSphereOffsets[si], count, mark, si, verts);
+        } else if (mSphereOffsets[chL+1] == mSphereOffsets[chL]) {
+            mSphere[si] = mSphere[chR];
+        } else {
+            mSphere[si] = mSphere[chL];
+            if (mSphereOffsets[chR+1] > mSphereOffsets[chR]) mSphere[si].extend(mSphere[chR]);
+        }
+    }
+}
+
+BvhStats Mesh::getBvhStats() const
+{
+    BvhStats st;
+    float rootArea = mAABB[0].box.getSurfaceArea();
+    unsigned long refs=0;
+    int leaves=0;
+
+    st.sahCost = 0;
+    for (int bi=0; bi<mAABB.size(); ++bi) {
+        if (mAABB[bi].box.isEmpty() || !rootArea) continue;
+        float p = mAABB[bi].box.getSurfaceArea()/rootArea;
+        if (!mAABB[bi].isLeaf()) {
+            st.sahCost += p;
+        } else {
+            int n = mAABB[bi].count;
+            st.sahCost += p*n;
+            refs += n;
+            if (n) ++leaves;
+        }
+    }
+    st.avgLeafSize = leaves ? (float)refs/leaves : 0;
+    st.duplication = mTriangles.size() ? (float)refs/mTriangles.size() : 0;
+
+    /* Count the different triangles under every node of each level.
+     * A triangle that went to both sides of a split counts twice. */
+    vector<int> depth, stack;
+    vector<int> seen(mTriangles.size(), -1);
+    int visit = 0;
+    boxDepths(depth);
+    for (int bvlevel=0; bvlevel<=BVL; ++bvlevel) {
+        unsigned long levelRefs = 0;
+        for (int bi=0; bi<mAABB.size(); ++bi) {
+            if (depth[bi]!=bvlevel && !(depth[bi]<bvlevel && mAABB[bi].isLeaf())) continue;
+            stack.assign(1, bi);
+            while (!stack.empty()) {
+                const BvhNode &node = mAABB[stack.back()];
+                stack.pop_back();
+                if (!node.isLeaf()) {
+                    stack.push_back(node.index);
+                    stack.push_back(node.index+1);
+                    continue;
                 }
-                if (Geom::intersects(boxR, t.getBox())) {
-                    mAABBTriangles[chR].push_back(*bvi);
-                    for (int vi=0; vi<3; ++vi) {
-                        Point &v = mVertices[t.v[vi]];
-                        if      (v.x > maxR.x) maxR.x = v.x;
-                        else if (v.x < minR.x) minR.x = v.x;
-                        if      (v.y > maxR.y) maxR.y = v.y;
-                        else if (v.y < minR.y) minR.y = v.y;
-                        if      (v.z > maxR.z) maxR.z = v.z;
-                        else if (v.z < minR.z) minR.z = v.z;
+                for (int i=node.index; i<node.index+node.count; ++i) {
+                    int ti = mAABBIndices[i];
+                    if (seen[ti] != visit) {
+                        seen[ti] = visit;
+                        ++levelRefs;
                     }
                 }
             }
-            mAABB[chL] = Box(minL, maxL).cropBox(boxL);
-            mAABB[chR] = Box(minR, maxR).cropBox(boxR);
+            ++visit;
         }
+        st.levelDuplication[bvlevel] = mTriangles.size() ? (float)levelRefs/mTriangles.size() : 0;
     }
+    return st;
 }
 
-void Mesh::createBoundingSphereHierarchy()
+Sphere Mesh::fitSphere(const int *tris, int count, vector<int> &mark, int stamp, vector<int> &verts) const
 {
-    set<int> setL, setR;
-    mSphere[0] = Sphere(mVertices, setL);
+    /* Each vertex once, without sorting */
+    verts.clear();
+    for (int i=0; i<count; ++i) {
+        const Triangle &t = mTriangles[tris[i]];
+        for (int k=0; k<3; ++k) {
+            if (mark[t.v[k]] == stamp) continue;
+            mark[t.v[k]] = stamp;
+            verts.push_back(t.v[k]);
+        }
+    }
+    return Geom::enclosingSphere(mVertices, verts);
+}
 
-    /*Construct a triangle list with all the triangles */
-    mSphereTriangles[0].clear();
-    for (int ti=0; ti < mTriangles.size(); ++ti)
-        mSphereTriangles[0].push_back(ti);
+void Mesh::createBoundingSphereHierarchy()
+{
+    vector<int> mark(mVertices.size(), -1);     // The last node that took each vertex
+    vector<int> verts(mVertices.size());        // The vertices of a node
+    for (int vi=0; vi<verts.size(); ++vi)
+        verts[vi] = vi;
+    mSphere[0] = Geom::enclosingSphere(mVertices, verts);
+
+    /* The root holds all the triangles. The nodes are created in the
+     * order of their indices, so the triangles of each one follow those
+     * of the one before it in the array. */
+    int n = mTriangles.size();
+    mSphereIndices.resize(n);
+    mSphereIndices.reserve((BVL+1)*n);
+    for (int ti=0; ti < n; ++ti)
+        mSphereIndices[ti] = ti;
+    mSphereOffsets.assign(BVL_SIZE(BVL)+1, 0);
+    mSphereOffsets[1] = n;
 
     for (int bvlevel=0; bvlevel<BVL; ++bvlevel) {
         int dim=0;
@@ -215,46 +956,263 @@ void Mesh::createBoundingSphereHierarchy()
             int parent = (1<<bvlevel) -1+div;
             int chL = 2*parent+1;
             int chR = 2*parent+2;
-            setL.clear();
-            setR.clear();
-            mSphereTriangles[chL].clear();
-            mSphereTriangles[chR].clear();
             float lim = mSphere[parent].center.data[dim];
 
-            list<int>::const_iterator bvi;
-            for (bvi=mSphereTriangles[parent].begin(); bvi!=mSphereTriangles[parent].end(); ++bvi) {
-                Triangle &t = mTriangles[*bvi];
-                if (mVertices[t.vi1].data[dim] < lim || mVertices[t.vi2].data[dim] < lim || mVertices[t.vi3].data[dim] < lim) {
-                    setL.insert(t.vi1);setL.insert(t.vi2);setL.insert(t.vi3);
-                    mSphereTriangles[chL].push_back(*bvi);
-                }
-                else {
-                    setR.insert(t.vi1);setR.insert(t.vi2);setR.insert(t.vi3);
-                    mSphereTriangles[chR].push_back(*bvi);
+            /* The left child first, then the right one */
+            int begin = mSphereOffsets[parent], end = mSphereOffsets[parent+1];
+            for (int side=0; side<2; ++side) {
+                for (int i=begin; i<end; ++i) {
+                    int ti = mSphereIndices[i];
+                    Triangle &t = mTriangles[ti];
+                    bool left = mVertices[t.vi1].data[dim] < lim || mVertices[t.vi2].data[dim] < lim || mVertices[t.vi3].data[dim] < lim;
+                    if (left == !side) mSphereIndices.push_back(ti);
                 }
+                mSphereOffsets[chL+side+1] = mSphereIndices.size();
             }
 
-            if (setL.size()) mSphere[chL] = Sphere(mVertices, setL);
-            else mSphere[chL] = Sphere();
-            if (setR.size()) mSphere[chR] = Sphere(mVertices, setR);
-            else mSphere[chR] = Sphere();
+            mSphere[chL] = fitSphere(mSphereIndices.data()+mSphereOffsets[chL], mSphereOffsets[chL+1]-mSphereOffsets[chL], mark, chL, verts);
+            mSphere[chR] = fitSphere(mSphereIndices.data()+mSphereOffsets[chR], mSphereOffsets[chR+1]-mSphereOffsets[chR], mark, chR, verts);
         }
         dim = (dim+1)%3;
     }
 }
 
+/**
+ * Finds the coordinates of the voxel centres along one axis.
+ */
+static void volumeSamples(float min, float max, float dl, vector<float> &samples)
+{
+    samples.clear();
+    for (float x=min+dl/2; x<max; x+=dl)
+        samples.push_back(x);
+}
+
 void Mesh::calculateVolume()
 {
-    const float dl = mAABB[0].getXSize()/VDIV;
+    const float dl = mAABB[0].box.getXSize()/mOpt.volumeDivs;
     if (dl<0.00001) return;
 
-    unsigned long int voxelInside=0, voxelTotal=0, xi=0;
+    float objVol;
+    mVoxels.clear();
+    mVoxelsReady = false;
+    if (mOpt.volumeMode == VOLUME_EXACT && isWatertight()) {
+        objVol = exactVolume();
+    } else {
+        if (mOpt.volumeMode == VOLUME_EXACT)
+            printf("Mesh is not watertight, scanning voxels instead \n");
+        objVol = createVoxels();
+    }
+
+    /* Calculate the coverage for every AABB level. The leaves above
+     * a level also take part in it. */
+    vector<float> xs, ys, zs;
+    unsigned long int voxelTotal;
+    float bVol;
+    vector<int> depth;
+    boxDepths(depth);
+
+    for (int bvlevel=0; bvlevel<=BVL; ++bvlevel) {
+        bVol=0;
+        for (int bi=0; bi<mAABB.size(); ++bi)
+            if (depth[bi]==bvlevel || (depth[bi]<bvlevel && mAABB[bi].isLeaf()))
+                bVol += mAABB[bi].box.getVolume();
+
+        AABBCover[bvlevel] = objVol/bVol;
+    }
+
+    int voxelCount[BVL+1];
+    for (int bvlevel=1; bvlevel<= BVL; bvlevel++)
+      voxelCount[bvlevel]=0;
+
+    /* Calculate the coverage for every Sphere level */
+    Box sB = mSphere[0].getBox();
+    float r = mSphere[0].rad;
+    float sBvol = 8.0 *r*r*r;
+    volumeSamples(sB.min.x, sB.max.x, dl, xs);
+    volumeSamples(sB.min.y, sB.max.y, dl, ys);
+    volumeSamples(sB.min.z, sB.max.z, dl, zs);
+    voxelTotal = xs.size()*ys.size()*zs.size();
+
+    if (mOpt.volumeMode == VOLUME_RAYS) {
+        for (int xi=0; xi<xs.size(); ++xi) {
+            for (int yi=0; yi<ys.size(); ++yi) {
+                for (int zi=0; zi<zs.size(); ++zi) {
+                    Point v(xs[xi],ys[yi],zs[zi]);
+                    for (int bvlevel=1; bvlevel<=BVL; ++bvlevel) {
+                        for (int bi=BVL_SIZE(bvlevel-1); bi< BVL_SIZE(bvlevel); ++bi) {
+                            if (mSphere[bi].contains(v)) {
+                                ++voxelCount[bvlevel];
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    else {
+        /* Every sphere covers an interval of each column. Count the
+         * voxel centres that fall in the union of the intervals of a level. */
+        vector<pair<float,float> > spans;
+        for (int xi=0; xi<xs.size(); ++xi) {
+            for (int yi=0; yi<ys.size(); ++yi) {
+                for (int bvlevel=1; bvlevel<=BVL; ++bvlevel) {
+                    spans.clear();
+                    for (int bi=BVL_SIZE(bvlevel-1); bi< BVL_SIZE(bvlevel); ++bi) {
+                        const Sphere &s = mSphere[bi];
+                        float dx = s.center.x-xs[xi], dy = s.center.y-ys[yi];
+                        float h = s.rad*s.rad - dx*dx - dy*dy;
+                        if (h <= 0) continue;
+                        h = sqrt(h);
+                        spans.push_back(make_pair(s.center.z-h, s.center.z+h));
+                    }
+                    sort(spans.begin(), spans.end());
+                    float covered = -FLT_MAX;
+                    for (int si=0; si<spans.size(); ++si) {
+                        float lo = std::max(spans[si].first, covered);
+                        if (spans[si].second <= lo) continue;
+                        voxelCount[bvlevel] += lower_bound(zs.begin(), zs.end(), spans[si].second) -
+                                               upper_bound(zs.begin(), zs.end(), lo);
+                        covered = spans[si].second;
+                    }
+                }
+            }
+        }
+    }
+
+    sphereCover[0] = objVol / mSphere[0].getVolume();
+    for (int bvlevel=1; bvlevel<= BVL; bvlevel++)
+        sphereCover[bvlevel] = objVol / (sBvol * ((float)voxelCount[bvlevel]/voxelTotal));
 
-    for (float x= mAABB[0].min.x+dl/2; x< mAABB[0].max.x; x+=dl) {
-        printf("[%c] [%-2d%%]", "|/-\\"[xi++%4], (int)(100*((x-mAABB[0].min.x)/mAABB[0].getXSize())));fflush(stdout);
-        for (float y= mAABB[0].min.y+dl/2; y< mAABB[0].max.y; y+=dl) {
-            for (float z= mAABB[0].min.z+dl/2; z< mAABB[0].max.z; z+=dl)
+}
+
+float Mesh::createVoxels()
+{
+    const float dl = mAABB[0].box.getXSize()/mOpt.volumeDivs;
+    mVoxels.clear();
+    mVoxelsReady = true;
+    if (dl<0.00001) return 0;
+
+    vector<float> xs, ys, zs;
+    volumeSamples(mAABB[0].box.min.x, mAABB[0].box.max.x, dl, xs);
+    volumeSamples(mAABB[0].box.min.y, mAABB[0].box.max.y, dl, ys);
+    volumeSamples(mAABB[0].box.min.z, mAABB[0].box.max.z, dl, zs);
+
+    unsigned long int voxelInside=0, voxelTotal=xs.size()*ys.size()*zs.size();
+    if (mOpt.volumeMode == VOLUME_RAYS)
+        voxelInside = scanVolumeRays(xs, ys, zs, dl);
+    else
+        voxelInside = scanVolumeColumns(xs, ys, zs, dl);
+    printf("             \r");
+
+    return (mAABB[0].box.getVolume()*voxelInside)/voxelTotal;
+}
+
+bool Mesh::isWatertight()
+{
+    /* Every edge must be shared by exactly two triangles that traverse it
+     * in opposite directions. Sort the directed edges by their undirected
+     * key and check that they come in such pairs. */
+    vector<pair<pair<int,int>,int> > edges;
+    edges.reserve(3*mTriangles.size());
+    vector<Triangle>::const_iterator ti;
+    for (ti=mTriangles.begin(); ti!=mTriangles.end(); ++ti) {
+        for (int i=0; i<3; ++i) {
+            int a = ti->v[i], b = ti->v[(i+1)%3];
+            if (a == b) return false;
+            edges.push_back(make_pair(make_pair(std::min(a,b), std::max(a,b)), a<b));
+        }
+    }
+    sort(edges.begin(), edges.end());
+
+    for (int e=0; e<edges.size(); e+=2) {
+        if (e+1 == edges.size() || edges[e].first != edges[e+1].first) return false;
+        if (edges[e].second == edges[e+1].second) return false;
+        if (e+2 < edges.size() && edges[e+2].first == edges[e].first) return false;
+    }
+    return true;
+}
+
+float Mesh::exactVolume()
+{
+    /* Sum the signed volumes of the tetrahedra formed by every triangle
+     * and the origin, in blocks of triangles that are summed in order. */
+    const int block = 1<<14;
+    int n = mTriangles.size();
+    int nblocks = (n+block-1)/block;
+    vector<double> sums(nblocks, 0.0);
+
+    Parallel::run(nblocks, [&](int b) {
+        int first = b*block, last = std::min(n, first+block);
+        int ti = first;
+        double sum = 0;
+#ifdef __SSE2__
+        /* Four triangles at a time */
+        __m128 acc = _mm_setzero_ps();
+        for (; ti+4 <= last; ti+=4) {
+            const Triangle *t = &mTriangles[ti];
+            const Point &a0 = t[0].v1(), &a1 = t[1].v1(), &a2 = t[2].v1(), &a3 = t[3].v1();
+            const Point &b0 = t[0].v2(), &b1 = t[1].v2(), &b2 = t[2].v2(), &b3 = t[3].v2();
+            const Point &c0 = t[0].v3(), &c1 = t[1].v3(), &c2 = t[2].v3(), &c3 = t[3].v3();
+            __m128 ax = _mm_set_ps(a3.x, a2.x, a1.x, a0.x);
+            __m128 ay = _mm_set_ps(a3.y, a2.y, a1.y, a0.y);
+            __m128 az = _mm_set_ps(a3.z, a2.z, a1.z, a0.z);
+            __m128 bx = _mm_set_ps(b3.x, b2.x, b1.x, b0.x);
+            __m128 by = _mm_set_ps(b3.y, b2.y, b1.y, b0.y);
+            __m128 bz = _mm_set_ps(b3.z, b2.z, b1.z, b0.z);
+            __m128 cx = _mm_set_ps(c3.x, c2.x, c1.x, c0.x);
+            __m128 cy = _mm_set_ps(c3.y, c2.y, c1.y, c0.y);
+            __m128 cz = _mm_set_ps(c3.z, c2.z, c1.z, c0.z);
+            /* a . (b x c) */
+            __m128 crx = _mm_sub_ps(_mm_mul_ps(by, cz), _mm_mul_ps(bz, cy));
+            __m128 cry = _mm_sub_ps(_mm_mul_ps(bz, cx), _mm_mul_ps(bx, cz));
+            __m128 crz = _mm_sub_ps(_mm_mul_ps(bx, cy), _mm_mul_ps(by, cx));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, crx), _mm_mul_ps(ay, cry)), _mm_mul_ps(az, crz));
+            acc = _mm_add_ps(acc, det);
+            /* Move the partial sums to double precision every now and then */
+            if ((ti & 0xFF) == 0) {
+                float part[4];
+                _mm_storeu_ps(part, acc);
+                sum += (double)part[0] + part[1] + part[2] + part[3];
+                acc = _mm_setzero_ps();
+            }
+        }
+        float part[4];
+        _mm_storeu_ps(part, acc);
+        sum += (double)part[0] + part[1] + part[2] + part[3];
+#endif
+        for (; ti < last; ++ti)
+            sum += Geom::dotprod(mTriangles[ti].v1(), Geom::crossprod(mTriangles[ti].v2(), mTriangles[ti].v3()));
+        sums[b] = sum;
+    });
+
+    double vol = 0;
+    for (int b=0; b<nblocks; ++b)
+        vol += sums[b];
+    return fabs(vol/6);
+}
+
+unsigned long Mesh::scanVolumeRays(const vector<float> &xs, const vector<float> &ys, const vector<float> &zs, float dl)
+{
+    unsigned long voxelInside=0;
+
+    /* Pack the triangles of every leaf by 4 for the batched ray test */
+    vector<vector<Triangle4> > packs(mAABB.size());
+    for (int bi=0; bi<mAABB.size(); ++bi) {
+        const BvhNode &node = mAABB[bi];
+        if (!node.isLeaf()) continue;
+        for (int i=0; i<node.count; i+=4)
+            packs[bi].push_back(Triangle4(mTriangles, &mAABBIndices[node.index+i], std::min(4, node.count-i)));
+    }
+
+    vector<int> stack;
+    for (int xi=0; xi<xs.size(); ++xi) {
+        printf("[%c] [%-2d%%]", "|/-\\"[xi%4], (int)(100*xi/xs.size()));fflush(stdout);
+        for (int yi=0; yi<ys.size(); ++yi) {
+            for (int zi=0; zi<zs.size(); ++zi)
             {
+                float x=xs[xi], y=ys[yi], z=zs[zi];
+
                 /* Construct ray */
                 Point ray0(x,y,z);
                 Point rayFar(x*20,y*20,z*20);
@@ -262,23 +1220,29 @@ void Mesh::calculateVolume()
 
                 /* Count intersecting triangles */
                 set<int>alreadyIntersected;
-                alreadyIntersected.clear();
-                list<int>::const_iterator ti;
-                int bvl = BVL;
-                for (int bi=BVL_SIZE(bvl-1); bi<BVL_SIZE(bvl); ++bi) {
-                    if (!Geom::intersects(mAABB[bi], ray)) continue;
-                    for (ti = mAABBTriangles[bi].begin(); ti!=mAABBTriangles[bi].end(); ++ti) {
-                        Triangle &t = mTriangles[*ti];
-                        if ((Geom::mkcode(ray.start, t.getBox()) & Geom::mkcode(ray.end, t.getBox()))) continue;
-                        if ( Geom::intersects(t, ray)) {
-			    alreadyIntersected.insert(*ti);
-                        }
+                vector<Triangle4>::const_iterator pi;
+                Ray slab(ray);
+                stack.clear();
+                if (Geom::intersects(mAABB[0].box, slab)) stack.push_back(0);
+                while (!stack.empty()) {
+                    int bi = stack.back();
+                    stack.pop_back();
+                    if (!mAABB[bi].isLeaf()) {
+                        /* Descend to the children that the ray crosses */
+                        int ch = mAABB[bi].index;
+                        int hit = Geom::intersects(mAABB[ch].box, mAABB[ch+1].box, slab);
+                        if (hit&1) stack.push_back(ch);
+                        if (hit&2) stack.push_back(ch+1);
+                        continue;
+                    }
+                    for (pi = packs[bi].begin(); pi!=packs[bi].end(); ++pi) {
+                        int hits = Geom::intersects(*pi, ray);
+                        for (int i=0; hits; ++i, hits>>=1)
+                            if (hits&1) alreadyIntersected.insert(pi->index[i]);
                     }
                 }
-                
-                ++voxelTotal;
-                
-		/* For odd number of triangles count this voxel to the total volume */
+
+                /* For odd number of triangles count this voxel to the total volume */
                 if (alreadyIntersected.size()%2 == 1){
                     mVoxels.push_back( Box (Point(x-dl/2.2, y-dl/2.2, z-dl/2.2), Point(x+dl/2.2, y+dl/2.2, z+dl/2.2)));
                     ++voxelInside;
@@ -287,142 +1251,283 @@ void Mesh::calculateVolume()
         }
         printf ("\r");
     }
-    printf("             \r");
 
-    /* Calculate the coverage for every AABB level */
-    float objVol = (mAABB[0].getVolume()*voxelInside)/voxelTotal;
-    float bVol, sVol;
+    return voxelInside;
+}
 
-    for (int bvlevel=0; bvlevel<=BVL; ++bvlevel) {
-        bVol=0;
-        for (int bi=BVL_SIZE(bvlevel-1); bi< BVL_SIZE(bvlevel); ++bi)
-            bVol += mAABB[bi].getVolume();
-	
-        AABBCover[bvlevel] = objVol/bVol;
-    }
+unsigned long Mesh::scanVolumeColumns(const vector<float> &xs, const vector<float> &ys, const vector<float> &zs, float dl)
+{
+    unsigned long voxelInside=0;
+    vector<pair<float,int> > hits;     // Depth and index of the triangles crossed by a column
+    vector<int> stack;                  // Nodes waiting to be visited
+
+    for (int xi=0; xi<xs.size(); ++xi) {
+        printf("[%c] [%-2d%%]", "|/-\\"[xi%4], (int)(100*xi/xs.size()));fflush(stdout);
+        for (int yi=0; yi<ys.size(); ++yi) {
+            float x=xs[xi], y=ys[yi], z;
+
+            /* Collect the depths of all the triangles crossed by the column */
+            hits.clear();
+            stack.assign(1, 0);
+            while (!stack.empty()) {
+                int bi = stack.back();
+                stack.pop_back();
+                const BvhNode &node = mAABB[bi];
+                const Box &b = node.box;
+                if (x < b.min.x || x > b.max.x || y < b.min.y || y > b.max.y) continue;
+                if (!node.isLeaf()) {
+                    stack.push_back(node.index+1);
+                    stack.push_back(node.index);
+                    continue;
+                }
+                for (int i=node.index; i<node.index+node.count; ++i) {
+                    int ti = mAABBIndices[i];
+                    if (Geom::intersectsColumn(mTriangles[ti], x, y, z))
+                        hits.push_back(make_pair(z, ti));
+                }
+            }
 
-    int voxelCount[BVL+1];
-    for (int bvlevel=1; bvlevel<= BVL; bvlevel++) 
-      voxelCount[bvlevel]=0;
-    
-    /* Calculate the coverage for every Sphere level */
-    Box sB = mSphere[0].getBox();
-    float r = mSphere[0].rad;
-    float sBvol = 8.0 *r*r*r;
-    voxelTotal = 0;
-    
-    for (float x= sB.min.x+dl/2; x< sB.max.x; x+=dl) {
-	for (float y= sB.min.y+dl/2; y< sB.max.y; y+=dl) {
-	    for (float z= sB.min.z+dl/2; z< sB.max.z; z+=dl) {
-		++voxelTotal;
-		Point v(x,y,z);
-		for (int bvlevel=1; bvlevel<=BVL; ++bvlevel) {
-		    for (int bi=BVL_SIZE(bvlevel-1); bi< BVL_SIZE(bvlevel); ++bi) {
-			if (mSphere[bi].contains(v)) {
-			    ++voxelCount[bvlevel];
-			    break;
-			}
-		    }
-		}
-	    } 
-	}  
-    }
-    
-    sphereCover[0] = objVol / mSphere[0].getVolume();
-    for (int bvlevel=1; bvlevel<= BVL; bvlevel++)
-	sphereCover[bvlevel] = objVol / (sBvol * ((float)voxelCount[bvlevel]/voxelTotal));
+            /* A triangle may belong to many leaves. Keep one hit of each. */
+            sort(hits.begin(), hits.end());
+            hits.erase(unique(hits.begin(), hits.end()), hits.end());
 
+            /* A voxel is inside when an odd number of hits lie below its centre */
+            int h=0;
+            for (int zi=0; zi<zs.size(); ++zi) {
+                while (h<hits.size() && hits[h].first < zs[zi]) ++h;
+                if (h%2 == 1) {
+                    z = zs[zi];
+                    mVoxels.push_back( Box (Point(x-dl/2.2, y-dl/2.2, z-dl/2.2), Point(x+dl/2.2, y+dl/2.2, z+dl/2.2)));
+                    ++voxelInside;
+                }
+            }
+        }
+        printf ("\r");
+    }
+
+    return voxelInside;
 }
 
-void Mesh::loadObj(string filename, vector<Point> &vertices, vector<Triangle> &triangles, bool ccw)
+void Mesh::intersect(const Mesh &m1, const Mesh &m2, vector<Point> &vertices, vector<Triangle> &triangles, bool both,
+                     CollisionStats *stats, CollisionMode mode)
 {
-    Point v;
-    int f1, f2, f3;
-    char line[128];
-    FILE *objfile;
-
-    if (!(objfile = fopen(filename.c_str(), "rt"))) return;
+    intersect(m1, m1.getTransform(), m2, m2.getTransform(), vertices, triangles, both, stats, mode);
+}
 
-    while (fgets(line, 128, objfile)) {
-        switch (line[0]) {
-        case 'v':
-            sscanf(&line[1],"%f %f %f", &v.x, &v.y, &v.z);
-            vertices.push_back(v);
-            break;
-        case 'f':
-            sscanf(&line[1],"%d%d%d", &f1, &f2, &f3);
-            if (ccw) triangles.push_back(Triangle(&vertices, --f1, --f3, --f2));
-            else triangles.push_back(Triangle(&vertices, --f1, --f2, --f3));
-            break;
-        default:
-            continue;
-        };
+void Mesh::leafTriangles(int node, CollisionMode mode, vector<int> &out) const
+{
+    if (mode == COLLIDE_SPHERES) {
+        out.insert(out.end(), mSphereIndices.begin()+mSphereOffsets[node], mSphereIndices.begin()+mSphereOffsets[node+1]);
+    } else {
+        const BvhNode &n = mAABB[node];
+        out.insert(out.end(), mAABBIndices.begin()+n.index, mAABBIndices.begin()+n.index+n.count);
     }
-
-    fclose(objfile);
 }
 
-void Mesh::intersect( Mesh &m1,  Mesh &m2, vector<Point> &vertices, vector<Triangle> &triangles, bool both)
+void Mesh::intersect(const Mesh &m1, const Transform &tr1, const Mesh &m2, const Transform &tr2,
+                     vector<Point> &vertices, vector<Triangle> &triangles, bool both,
+                     CollisionStats *stats, CollisionMode mode)
 {
     //TODO: Eliminate vertex repetition
 
+    CollisionStats dummy;
+    if (!stats) stats = &dummy;
+
+    /* Everything is done in the local frame of m1. This transformation
+     * brings the vertices and the volumes of m2 there. Spheres only
+     * need their centre moved, boxes have to be re-boxed. */
+    Transform rel = tr1.inverse() * tr2;
+
     /* Trivial check */
-    Box bbox1 = Box(m1.getBox()).add(m1.mPos);
-    Box bbox2 = Box(m2.getBox()).add(m2.mPos);
-    if (!Geom::intersects (bbox1, bbox2)) return;
+    if (mode == COLLIDE_SPHERES) {
+        Sphere s2(rel.apply(m2.mSphere[0].center), m2.mSphere[0].rad);
+        if (!Geom::intersects (m1.mSphere[0], s2)) return;
+    }
+    else if (!Geom::intersects (m1.mAABB[0].box, rel.apply(m2.mAABB[0].box))) return;
 
     vector<Triangle> const &mt1 = m1.mTriangles;    // Just for a shorter name
     vector<Triangle> const &mt2 = m2.mTriangles;    // Just for a shorter name
-    int bi1, bi2;                                   // Indices to models' bounding boxes
-    list<int>::const_iterator mti1, mti2;           // Iterators for trianges of boxes'
+    int bi1, bi2;                                   // Indices to the nodes of the hierarchies
+    int nodes1, nodes2;                             // Number of nodes of the hierarchies
     vector<bool> mtCol1, mtCol2;                    // Flags indicating that a triangle has already collided
     unsigned int count=0;                           // Count intersecting triangles
-
-    /* Bring objects to theis actual positions */
-    m1.hardTranslate(m1.mPos);
-    m2.hardTranslate(m2.mPos);
+    vector<pair<int,int> > stack;                   // Pairs of nodes waiting to be tested
+    vector<pair<int,int> > leaves;                  // Pairs of overlapping leaves
+    vector<int> leafTris1;                          // Triangles of the visited leaves of m1, one leaf after the other
+    vector<Point> leafVertices;                     // Vertices of the visited leaves of m2, moved to the frame of m1
+    vector<Triangle> leafTriangles;                 // Triangles of the visited leaves of m2, moved to the frame of m1
+    vector<int> leafIndex;                          // Index in m2 of each of the moved triangles
 
     mtCol1.resize(mt1.size(), 0);
     if (both) mtCol2.resize(mt2.size(), 0);
 
-    for (bi1=BVL_SIZE(BVL-1); bi1<BVL_SIZE(BVL); ++bi1) {
-        for (bi2=BVL_SIZE(BVL-1); bi2<BVL_SIZE(BVL); ++bi2) {
-            if (Geom::intersects(m1.mAABB[bi1], m2.mAABB[bi2])) {
-                for (mti1 = m1.mAABBTriangles[bi1].begin(); mti1!=m1.mAABBTriangles[bi1].end(); ++mti1) {
-                    if (Geom::intersects(mt1[*mti1].box, m2.mAABB[bi2])) {
-                        for (mti2 = m2.mAABBTriangles[bi2].begin(); mti2!=m2.mAABBTriangles[bi2].end(); ++mti2) {
-                            if ( Geom::intersects(mt1[*mti1], mt2[*mti2]) ) {
-                                /* Add the colliding triangle of the first model. */
-                                if (!mtCol1[*mti1]) {
-                                    vertices.push_back(mt1[*mti1].v1());
-                                    vertices.push_back(mt1[*mti1].v2());
-                                    vertices.push_back(mt1[*mti1].v3());
-                                    triangles.push_back(Triangle(&vertices, 3*count, 3*count+1, 3*count+2));
-                                    mtCol1[*mti1]=true;
-                                    ++count;
-                                }
-                                /* Add the colliding triangle of the second model. (Only if both is set) */
-                                if (both && !mtCol2[*mti2]) {
-                                    vertices.push_back(mt2[*mti2].v1());
-                                    vertices.push_back(mt2[*mti2].v2());
-                                    vertices.push_back(mt2[*mti2].v3());
-                                    triangles.push_back(Triangle(&vertices, 3*count, 3*count+1, 3*count+2));
-                                    mtCol2[*mti2]=true;
-                                    ++count;
-                                }
-                            }
-                        }
-                    }
+    nodes1 = mode == COLLIDE_SPHERES ? m1.mSphere.size() : m1.mAABB.size();
+    nodes2 = mode == COLLIDE_SPHERES ? m2.mSphere.size() : m2.mAABB.size();
+
+    /* Descend both hierarchies at once, starting from the roots. */
+    stack.push_back(make_pair(0, 0));
+    while (!stack.empty()) {
+        bi1 = stack.back().first;
+        bi2 = stack.back().second;
+        stack.pop_back();
+        ++stats->nodePairs;
+
+        int ch1, ch2;
+        bool split1;
+        if (mode == COLLIDE_SPHERES) {
+            /* The sphere hierarchy is a complete tree. Its empty
+             * nodes are never pushed. */
+            const Sphere &s1 = m1.mSphere[bi1];
+            Sphere s2(rel.apply(m2.mSphere[bi2].center), m2.mSphere[bi2].rad);
+            ++stats->sphereTests;
+            if (!Geom::intersects(s1, s2)) {
+                ++stats->culledPairs;
+                continue;
+            }
+            ch1 = bi1 < BVL_SIZE(BVL-1) ? 2*bi1+1 : 0;
+            ch2 = bi2 < BVL_SIZE(BVL-1) ? 2*bi2+1 : 0;
+            split1 = s1.rad >= s2.rad;
+        } else {
+            const BvhNode &n1 = m1.mAABB[bi1];
+            const BvhNode &n2 = m2.mAABB[bi2];
+            Box b2 = rel.apply(n2.box);
+            float vol1 = n1.box.getVolume();
+            float vol2 = b2.getVolume();
+            bool overlap;
+            if (mode == COLLIDE_BOXES) {
+                ++stats->boxTests;
+                overlap = Geom::intersects(n1.box, b2);
+            } else {
+                /* Each node offers the tighter of its two volumes. Empty
+                 * nodes keep their box, which overlaps nothing. */
+                const Sphere &s1 = m1.mNodeSpheres[bi1];
+                Sphere s2(rel.apply(m2.mNodeSpheres[bi2].center), m2.mNodeSpheres[bi2].rad);
+                float svol1 = 4.0f/3.0f*PI*s1.rad*s1.rad*s1.rad;
+                float svol2 = 4.0f/3.0f*PI*s2.rad*s2.rad*s2.rad;
+                bool box1 = n1.box.isEmpty() || vol1 <= svol1;
+                bool box2 = b2.isEmpty() || vol2 <= svol2;
+                if (box1 && box2) {
+                    ++stats->boxTests;
+                    overlap = Geom::intersects(n1.box, b2);
+                } else if (!box1 && !box2) {
+                    ++stats->sphereTests;
+                    overlap = Geom::intersects(s1, s2);
+                } else {
+                    ++stats->mixedTests;
+                    overlap = box1 ? Geom::intersects(n1.box, s2) : Geom::intersects(b2, s1);
                 }
             }
+            if (!overlap) {
+                ++stats->culledPairs;
+                continue;
+            }
+            ch1 = n1.isLeaf() ? 0 : n1.index;
+            ch2 = n2.isLeaf() ? 0 : n2.index;
+            split1 = vol1 >= vol2;
+        }
+
+        /* Split the larger of the two nodes, or the one that is not a leaf */
+        if (ch1 && (!ch2 || split1)) {
+            for (int ch=ch1+1; ch>=ch1; --ch)
+                if (mode != COLLIDE_SPHERES || m1.mSphereOffsets[ch+1] > m1.mSphereOffsets[ch])
+                    stack.push_back(make_pair(ch, bi2));
+            continue;
+        }
+        if (ch2) {
+            for (int ch=ch2+1; ch>=ch2; --ch)
+                if (mode != COLLIDE_SPHERES || m2.mSphereOffsets[ch+1] > m2.mSphereOffsets[ch])
+                    stack.push_back(make_pair(bi1, ch));
+            continue;
+        }
+
+        leaves.push_back(make_pair(bi1, bi2));
+    }
+    stats->leafPairs += leaves.size();
+
+    /* Gather the triangles of the overlapping leaves. Those of m2 are moved
+     * to the frame of m1. Each leaf is gathered once, no matter how many
+     * leaves of the other mesh it touches. */
+    vector<int> leafStart1(nodes1, -1), leafCount1(nodes1, 0);
+    vector<int> leafStart2(nodes2, -1), leafCount2(nodes2, 0);
+    vector<int> tris;
+    for (int li=0; li<leaves.size(); ++li) {
+        bi1 = leaves[li].first;
+        if (leafStart1[bi1] < 0) {
+            leafStart1[bi1] = leafTris1.size();
+            m1.leafTriangles(bi1, mode, leafTris1);
+            leafCount1[bi1] = leafTris1.size() - leafStart1[bi1];
+        }
+        bi2 = leaves[li].second;
+        if (leafStart2[bi2] >= 0) continue;
+        leafStart2[bi2] = leafTriangles.size();
+        tris.clear();
+        m2.leafTriangles(bi2, mode, tris);
+        leafCount2[bi2] = tris.size();
+        for (int i=0; i<tris.size(); ++i) {
+            const Triangle &t2 = mt2[tris[i]];
+            int vi = leafVertices.size();
+            leafVertices.push_back(rel.apply(t2.v1()));
+            leafVertices.push_back(rel.apply(t2.v2()));
+            leafVertices.push_back(rel.apply(t2.v3()));
+            leafTriangles.push_back(Triangle(&leafVertices, vi, vi+1, vi+2));
+            leafIndex.push_back(tris[i]);
         }
     }
 
-    /* Send models back to their origin */
-    Point restore = Point(m1.mPos).scale(-1);
-    m1.hardTranslate(restore);
-    restore = Point(m2.mPos).scale(-1);;
-    m2.hardTranslate(restore);
+    /* Test the triangles of the overlapping leaves. Each leaf pair is a task
+     * that keeps its own list of colliding triangle pairs. Sorting the pairs
+     * keeps the leaves of m1 in cache and the output order stable. */
+    sort(leaves.begin(), leaves.end());
+    vector<vector<pair<int,int> > > hits(leaves.size());
+    vector<unsigned long> tested(leaves.size(), 0);
+    Parallel::steal(leaves.size(), [&](int li) {
+        int bi1 = leaves[li].first;
+        int bi2 = leaves[li].second;
+        Box box2;
+        if (mode == COLLIDE_SPHERES)
+            box2 = Sphere(rel.apply(m2.mSphere[bi2].center), m2.mSphere[bi2].rad).getBox();
+        else
+            box2 = rel.apply(m2.mAABB[bi2].box);
+        for (int i=leafStart1[bi1]; i<leafStart1[bi1]+leafCount1[bi1]; ++i) {
+            int ti1 = leafTris1[i];
+            if (!Geom::intersects(mt1[ti1].box, box2)) continue;
+            int ti2 = leafStart2[bi2];
+            for (int j=0; j<leafCount2[bi2]; ++j, ++ti2) {
+                ++tested[li];
+                if (Geom::intersects(mt1[ti1], leafTriangles[ti2]))
+                    hits[li].push_back(make_pair(ti1, ti2));
+            }
+        }
+    });
+
+    /* Merge the hits in task order, so that the output is the same
+     * for any number of threads. Duplicates are dropped here. */
+    for (int li=0; li<leaves.size(); ++li) {
+        stats->trianglePairs += tested[li];
+        for (int h=0; h<hits[li].size(); ++h) {
+            int ti1 = hits[li][h].first;
+            int ti2 = leafIndex[hits[li][h].second];
+            const Triangle &t2 = leafTriangles[hits[li][h].second];
+            /* Add the colliding triangle of the first model. */
+            if (!mtCol1[ti1]) {
+                vertices.push_back(mt1[ti1].v1());
+                vertices.push_back(mt1[ti1].v2());
+                vertices.push_back(mt1[ti1].v3());
+                triangles.push_back(Triangle(&vertices, 3*count, 3*count+1, 3*count+2));
+                mtCol1[ti1]=true;
+                ++count;
+            }
+            /* Add the colliding triangle of the second model. (Only if both is set) */
+            if (both && !mtCol2[ti2]) {
+                vertices.push_back(t2.v1());
+                vertices.push_back(t2.v2());
+                vertices.push_back(t2.v3());
+                triangles.push_back(Triangle(&vertices, 3*count, 3*count+1, 3*count+2));
+                mtCol2[ti2]=true;
+                ++count;
+            }
+        }
+    }
 }
 
 
@@ -434,7 +1539,7 @@ struct TriangleCost
 
     static vector<Triangle>  * tVec;
     static vector<Point>     * nVec;
-    static vector<set<int> > * sVec;
+    static MutableAdjacency  * sVec;
 
     TriangleCost (int _index, bool calcCost=false) :
         index(_index)
@@ -453,158 +1558,450 @@ struct TriangleCost
     {
         float sum;                  // sum the dot products
         Point n1,n2;                // Temp for normals
-        set<int>::iterator tli;     // iterator for vertex's triangles
+        const int *tli;             // iterator for vertex's triangles
 
         vector<Triangle> &trian = *tVec;
-        vector<set<int> > &vtl = *sVec;
+        MutableAdjacency &vtl = *sVec;
+
+        /* A lone triangle has no neighbours to compare with */
+        if (vtl.size(trian[index].vi1) < 2) {
+            cost = 1;
+            return;
+        }
 
-        tli = vtl[trian[index].vi1].begin();
+        tli = vtl.begin(trian[index].vi1);
         n2  = trian[*tli].getNormal();
         ++tli;
         sum = 0;
 
-        while (tli != vtl[trian[index].vi1].end()) {
+        while (tli != vtl.end(trian[index].vi1)) {
             n1 = n2;
             n2 = trian[*tli].getNormal();
             sum += Geom::dotprod(n1, n2);
             ++tli;
         }
 
-        cost = sum / (vtl[trian[index].vi1].size()-1);
+        cost = sum / (vtl.size(trian[index].vi1)-1);
     }
-
-    bool operator<(TriangleCost rhs) { return cost < rhs.cost; }
-
-    bool operator== (const TriangleCost &t) { return (index == t.index); }
-
-    bool operator!= (const TriangleCost &t) { return !(*this == t); }
-
 };
 
 vector<Triangle>  * TriangleCost::tVec;
 vector<Point>     * TriangleCost::nVec;
-vector<set<int> > * TriangleCost::sVec;
+MutableAdjacency  * TriangleCost::sVec;
 
 void Mesh::simplify(int percent)
 {
+    simplify(SimplifyOptions(percent));
+}
+
+void Mesh::simplify(const SimplifyOptions &opt)
+{
+    clock_t t = clock();
+    clearProgressive();
+    int target = opt.triangles > 0 ? opt.triangles : mTriangles.size()*opt.percent/100;
+    double deadline = opt.seconds > 0 ? Parallel::seconds()+opt.seconds : 0;
+    if (opt.engine == SIMPLIFY_QUADRIC && opt.parallel)
+        simplifyParallel(target, opt.maxError, deadline);
+    else if (opt.engine == SIMPLIFY_QUADRIC)
+        simplifyQuadric(target, opt.maxError, deadline);
+    else
+        simplifyNormals(target, deadline);
+
+    /* Clean up the data structures holding the model data */
+    vector<int> newIndex(mTriangles.size(), -1);
+    int kept = 0;
+    for (int ti=0; ti < mTriangles.size(); ++ti) {
+        if (mTriangles[ti].deleted) continue;
+        newIndex[ti] = kept;
+        mTriangles[kept++] = mTriangles[ti];
+    }
+    mTriangles.erase(mTriangles.begin()+kept, mTriangles.end());
+
+    createTriangleLists();
+    updateTriangleData();
+    createNormals();
+
+    /* The collapses are local, so the old hierarchies are refitted.
+     * They are rebuilt only when the boxes have become too loose. */
+    refitBoundingVolHierarchy(newIndex);
+    float growth = mBvhCost > 0 ? getBvhStats().sahCost/mBvhCost : 0;
+    bool rebuild = growth > REFIT_LIMIT;
+    if (rebuild) createBoundingVolHierarchy();
+    ++mVersion;
+    printf ("Mesh reduction took:\t%4.2f sec | %d triangles | hierarchy %s, cost x%.2f \n",
+            ((float)clock()-t)/CLOCKS_PER_SEC, (int)mTriangles.size(), rebuild ? "rebuilt" : "refitted", growth);
+}
+
+void Mesh::simplifyNormals(int target, double deadline)
+{
+    /* The lists of the triangles of the vertices change with every collapse */
+    MutableAdjacency vtl(mVertices.size(), mTriangles);
+
     /* Set these pointers */
     TriangleCost::tVec = &mTriangles;
     TriangleCost::nVec = &mVertexNormals;
-    TriangleCost::sVec = &mVertexTriangles;
+    TriangleCost::sVec = &vtl;
 
-    clock_t t = clock();
-    list<TriangleCost> procList;            // List of candidate triangles for collapse
-    list<TriangleCost>::iterator pli;       // Iterator for the list above
+    IndexedHeap heap;                       // Candidate triangles for collapse, by cost
+    vector<int> mark(mVertices.size(), -1); // The last collapse that touched each vertex
     int ti, tx;                             // Indices of current triangles proccessed
 
-    /* Populate triangle list with all the triangles and sort it */
-    pli = procList.begin();
+    /* Queue all the triangles by their cost */
+    vector<float> costs(mTriangles.size());
     for (ti=0; ti < mTriangles.size(); ++ti)
-        pli = procList.insert(pli, TriangleCost(ti, true));
+        costs[ti] = TriangleCost(ti, true).cost;
+    heap.build(costs);
 
-    procList.sort();
-
-    int desiredRemovals = mTriangles.size()*(100-percent)/100;
+    int desiredRemovals = mTriangles.size()-target;
     int removals = 0;
 
     /* Do the proccessing */
-    while (procList.size() > 10 && removals < desiredRemovals) {
+    while (heap.size() > 10 && removals < desiredRemovals) {
+        if (deadline > 0 && !(removals & 255) && Parallel::seconds() > deadline)
+            break;
 
-        /*0. Pick the next triangle for removal */
-        ti = procList.begin()->index;
-        if (mTriangles[ti].deleted){
-            procList.erase(procList.begin());
+        /*0. Pick the next triangle for removal. Deleted triangles are
+         * left in the heap and dropped when they come up. */
+        ti = heap.pop();
+        if (mTriangles[ti].deleted)
             continue;
-        }
 
         /*1. Pick two vertices that will form the collapsing edge */
         int vk = mTriangles[ti].vi1;                // Vertex we keep of the collapsing edge
         int vx = mTriangles[ti].vi2;                // Vertex we discard of the collapsing edge
-        set<int> &vkList = mVertexTriangles[vk];    // Reference to vertex's Vk triangle list
-        set<int> &vxList = mVertexTriangles[vx];    // Reference to vertex's Vx triangle list
-        set<int>::iterator vkLi, vxLi;              // Iterators for vertex triangle lists
+        const int *vkLi, *vxLi;                     // Iterators for vertex triangle lists
 
         /*2. Find the second triangle, apart ti, with edge [vk,vx]=tx */
-        vxLi = vxList.begin();
-        vkLi = vkList.begin();
+        vxLi = vtl.begin(vx);
+        vkLi = vtl.begin(vk);
         tx = -1;
-        while (vxLi != vxList.end() && vkLi != vkList.end()) {
+        while (vxLi != vtl.end(vx) && vkLi != vtl.end(vk)) {
             if (*vxLi < *vkLi) ++vxLi;
             else if (*vxLi > *vkLi) ++vkLi;
             else { if (*vxLi == ti) { ++vxLi; ++vkLi; }
                 else { tx = *vxLi; break; }}
         }
 
-        if (tx==-1 || mTriangles[tx].deleted) {
-            procList.erase(procList.begin());
+        /* Not collapsible for now. It is queued again if a
+         * collapse nearby changes its neighbourhood. */
+        if (tx==-1 || mTriangles[tx].deleted)
             continue;
-        }
 
-        /*3. Delete the triangles of the collapsing edge */
+        /*3. Delete the triangles of the collapsing edge, also from
+         * the lists of their third vertices */
         mTriangles[ti].deleted = 1;
         mTriangles[tx].deleted = 1;
+        for (int k=0; k<3; ++k) {
+            vtl.erase(mTriangles[ti].v[k], ti);
+            vtl.erase(mTriangles[tx].v[k], tx);
+        }
 
         /*5. Update the affected triangles' vertices */
-        for (vxLi = vxList.begin(); vxLi != vxList.end(); ++vxLi) {
-            if (!mTriangles[*vxLi].deleted) {
-                if      (mTriangles[*vxLi].vi1==vx) mTriangles[*vxLi].vi1 = vk;
-                else if (mTriangles[*vxLi].vi2==vx) mTriangles[*vxLi].vi2 = vk;
-                else if (mTriangles[*vxLi].vi3==vx) mTriangles[*vxLi].vi3 = vk;
-            }
+        for (vxLi = vtl.begin(vx); vxLi != vtl.end(vx); ++vxLi) {
+            if      (mTriangles[*vxLi].vi1==vx) mTriangles[*vxLi].vi1 = vk;
+            else if (mTriangles[*vxLi].vi2==vx) mTriangles[*vxLi].vi2 = vk;
+            else if (mTriangles[*vxLi].vi3==vx) mTriangles[*vxLi].vi3 = vk;
         }
 
         /* Place the new vertex in the middle of the collapsed edge */
         mVertices[vk] = Point(mVertices[vk]).add(mVertices[vx]).scale(0.5);
 
         /*6. Move the triangle list of the discarded vertex to the one we keeped */
-        vkList.insert(vxList.begin(), vxList.end());
-        vxList.clear();
-        vkList.erase(ti);
-        vkList.erase(tx);
-
-        /* 7. Remove all the triangles of this area of the process list */
-        procList.erase(procList.begin()); // Faster way for: procList.remove(ti);
-        procList.remove(tx);
-        for (vkLi = vkList.begin(); vkLi != vkList.end(); ++vkLi) {
-            procList.remove(*vkLi);
+        vtl.merge(vk, vx);
+
+        /*7. The triangles around vk have moved. Every triangle whose
+         * first vertex touches them gets a new cost. */
+        for (vkLi = vtl.begin(vk); vkLi != vtl.end(vk); ++vkLi)
+            mTriangles[*vkLi].update();
+        for (vkLi = vtl.begin(vk); vkLi != vtl.end(vk); ++vkLi) {
+            for (int k=0; k<3; ++k) {
+                int v = mTriangles[*vkLi].v[k];
+                if (mark[v] == ti) continue;
+                mark[v] = ti;
+                const int *vli;
+                for (vli = vtl.begin(v); vli != vtl.end(v); ++vli)
+                    if (mTriangles[*vli].vi1 == v)
+                        heap.push(*vli, TriangleCost(*vli, true).cost);
+            }
         }
 
-        //procList.sort(); // Won't improve quality, so dont do it.
-
         removals += 2;
     }
+}
 
-    /* Clean up the data structures holding the model data */
-    int from, to;
-    for (from=0; from < mTriangles.size();   ) {
-        if (mTriangles[from].deleted) {
-            for (to=from; to+1<mTriangles.size() && mTriangles[to+1].deleted ; ++to);
-            mTriangles.erase(mTriangles.begin()+from, mTriangles.begin()+to+1);
-        } else ++from;
+/**
+ * Quadric error of a vertex: the symmetric 4x4 matrix that sums the
+ * planes of its triangles. The error of a point is the sum of its
+ * squared distances from those planes.
+ */
+struct Quadric
+{
+    double q[10];   ///< aa ab ac ad bb bc bd cc cd dd
+
+    Quadric ()
+    {
+        for (int i=0; i<10; ++i) q[i] = 0;
     }
 
-    createTriangleLists();
-    updateTriangleData();
-    createNormals();
-    createBoundingVolHierarchy();
-    printf ("Mesh reduction took:\t%4.2f sec | %d triangles \n", ((float)clock()-t)/CLOCKS_PER_SEC, mTriangles.size());
+    /** The quadric of the plane ax+by+cz+d=0, times weight. */
+    Quadric (double a, double b, double c, double d, double weight=1)
+    {
+        q[0] = a*a; q[1] = a*b; q[2] = a*c; q[3] = a*d;
+        q[4] = b*b; q[5] = b*c; q[6] = b*d;
+        q[7] = c*c; q[8] = c*d;
+        q[9] = d*d;
+        for (int i=0; i<10; ++i) q[i] *= weight;
+    }
+
+    void add (const Quadric &o)
+    {
+        for (int i=0; i<10; ++i) q[i] += o.q[i];
+    }
+
+    double error (const Point &p) const
+    {
+        double x=p.x, y=p.y, z=p.z;
+        return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+             + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+             + q[7]*z*z + 2*q[8]*z
+             + q[9];
+    }
+
+    /**
+     * The point of the least error, if the planes pin it down.
+     * Flat or cylindrical neighbourhoods leave it free and return false.
+     */
+    bool optimum (Point &p) const
+    {
+        double det = q[0]*(q[4]*q[7]-q[5]*q[5]) - q[1]*(q[1]*q[7]-q[5]*q[2]) + q[2]*(q[1]*q[5]-q[4]*q[2]);
+        double scale = q[0]+q[4]+q[7];
+        if (fabs(det) <= 1e-9*scale*scale*scale) return false;
+        double bx=-q[3], by=-q[6], bz=-q[8];
+        p.x = (bx*(q[4]*q[7]-q[5]*q[5]) - q[1]*(by*q[7]-q[5]*bz) + q[2]*(by*q[5]-q[4]*bz))/det;
+        p.y = (q[0]*(by*q[7]-bz*q[5]) - bx*(q[1]*q[7]-q[5]*q[2]) + q[2]*(q[1]*bz-by*q[2]))/det;
+        p.z = (q[0]*(q[4]*bz-q[5]*by) - q[1]*(q[1]*bz-by*q[2]) + bx*(q[1]*q[5]-q[4]*q[2]))/det;
+        return true;
+    }
+};
+
+/** Weight of the planes that hold the open borders of a mesh in place */
+static const double BORDER_WEIGHT = 100;
+
+/**
+ * Error of collapsing the edge [a,b] to the best point for the two
+ * quadrics, which is returned in p. Without a unique optimum the best
+ * of the two ends and the middle is taken.
+ */
+static float collapseCost(const vector<Quadric> &quad, const vector<Point> &verts, int a, int b, Point &p)
+{
+    Quadric q = quad[a];
+    q.add(quad[b]);
+    if (q.optimum(p)) return max(0.0, q.error(p));
+    Point c[3] = {verts[a], verts[b], Point(verts[a]).add(verts[b]).scale(0.5f)};
+    double best = DBL_MAX;
+    for (int i=0; i<3; ++i) {
+        double e = q.error(c[i]);
+        if (e < best) { best = e; p = c[i]; }
+    }
+    return max(0.0, best);
 }
 
-void Mesh::hardTranslate(const Point &p)
+void Mesh::simplifyQuadric(int target, float maxError, double deadline, const vector<bool> *locked,
+                           vector<VertexSplit> *splits, vector<int> *corners, vector<int> *removed)
 {
-    vector<Point>::iterator vi;
-    for (vi=mVertices.begin(); vi!= mVertices.end(); ++vi)
-        vi->add(p);
+    int nv = mVertices.size();
+    vector<Quadric> quad(nv);               // Quadric of each vertex
+    vector<int> edgeV;                      // The two vertices of each edge
+    vector<Point> edgeP;                    // Where each edge collapses to
+    vector<vector<int> > vertexEdges(nv);   // Edges of each vertex
+    vector<int> mark(nv, -1);               // Stamp of the last visit of each vertex
+    MutableAdjacency adj(nv, mTriangles);   // Triangles of each vertex, as they collapse
+    int stamp = 0;
+    int live = 0;
+
+    /* Sum the planes of the triangles at their vertices. The open
+     * borders get a plane at right angles, so that they do not shrink. */
+    for (int ti=0; ti < mTriangles.size(); ++ti) {
+        const Triangle &t = mTriangles[ti];
+        if (t.deleted) continue;
+        ++live;
+        double len = sqrt((double)t.A*t.A + (double)t.B*t.B + (double)t.C*t.C);
+        if (len == 0) continue;
+        Quadric k(t.A/len, t.B/len, t.C/len, t.D/len);
+        for (int i=0; i<3; ++i)
+            quad[t.v[i]].add(k);
+
+        Point n = Point(t.A, t.B, t.C).scale(1/len);
+        for (int i=0; i<3; ++i) {
+            int a = t.v[i], b = t.v[(i+1)%3];
+            const int *ai = adj.begin(a), *bi = adj.begin(b);
+            int shared = 0;
+            while (ai != adj.end(a) && bi != adj.end(b)) {
+                if (*ai < *bi) ++ai;
+                else if (*bi < *ai) ++bi;
+                else { ++shared; ++ai; ++bi; }
+            }
+            if (shared != 1) continue;
+            Point m = Geom::crossprod(Point(mVertices[b]).sub(mVertices[a]), n);
+            if (m.length() == 0) continue;
+            m.normalize();
+            Quadric border(m.x, m.y, m.z, -Geom::dotprod(m, mVertices[a]), BORDER_WEIGHT);
+            quad[a].add(border);
+            quad[b].add(border);
+        }
+    }
 
-    for (int bi=0; bi<BVL_SIZE(BVL); ++bi)
-        mAABB[bi].add(p);
+    /* One edge for each pair of vertices that share a triangle */
+    for (int a=0; a<nv; ++a) {
+        const int *tli;
+        for (tli = adj.begin(a); tli != adj.end(a); ++tli) {
+            for (int i=0; i<3; ++i) {
+                int b = mTriangles[*tli].v[i];
+                if (b <= a || mark[b] == a) continue;
+                mark[b] = a;
+                vertexEdges[a].push_back(edgeV.size()/2);
+                vertexEdges[b].push_back(edgeV.size()/2);
+                edgeV.push_back(a);
+                edgeV.push_back(b);
+            }
+        }
+    }
+    stamp = nv;
+
+    edgeP.resize(edgeV.size()/2);
+    vector<float> costs(edgeP.size());
+    IndexedHeap heap;
+    for (int e=0; e<edgeP.size(); ++e)
+        costs[e] = collapseCost(quad, mVertices, edgeV[2*e], edgeV[2*e+1], edgeP[e]);
+    heap.build(costs);
+
+    vector<int> shared;
+    int collapses = 0;
+    while (live > target && !heap.empty()) {
+        if (deadline > 0 && !(++collapses & 255) && Parallel::seconds() > deadline)
+            break;
+        int e = heap.top();
+        if (maxError > 0 && heap.cost(e) > maxError)
+            break;
+        heap.pop();
+
+        int a = edgeV[2*e], b = edgeV[2*e+1];   // a is kept, b goes
+        const Point p = edgeP[e];
+        if (locked && ((*locked)[a] || (*locked)[b])) continue;
+
+        /* The triangles of the edge */
+        shared.clear();
+        set_intersection(adj.begin(a), adj.end(a), adj.begin(b), adj.end(b), back_inserter(shared));
+        if (shared.empty()) continue;
+
+        /* Keep the mesh a manifold. The two ends may have no other
+         * common neighbours than the third vertices of the edge's triangles. */
+        ++stamp;
+        for (int i=0; i<vertexEdges[a].size(); ++i) {
+            int ei = vertexEdges[a][i];
+            mark[edgeV[2*ei] == a ? edgeV[2*ei+1] : edgeV[2*ei]] = stamp;
+        }
+        int common = 0;
+        for (int i=0; i<vertexEdges[b].size(); ++i) {
+            int ei = vertexEdges[b][i];
+            if (mark[edgeV[2*ei] == b ? edgeV[2*ei+1] : edgeV[2*ei]] == stamp) ++common;
+        }
+        if (common != shared.size()) continue;
+
+        /* Do not let any of the remaining triangles fold over. Rejected
+         * edges come back when a collapse nearby gives them a new cost. */
+        bool folds = false;
+        for (int k=0; k<2 && !folds; ++k) {
+            int v = k ? b : a;
+            const int *tli;
+            for (tli = adj.begin(v); tli != adj.end(v) && !folds; ++tli) {
+                if (binary_search(shared.begin(), shared.end(), *tli)) continue;
+                const Triangle &t = mTriangles[*tli];
+                Point q[3] = {t.v1(), t.v2(), t.v3()};
+                for (int i=0; i<3; ++i)
+                    if (t.v[i] == v) q[i] = p;
+                Point n = Geom::crossprod(Point(q[1]).sub(q[0]), Point(q[2]).sub(q[0]));
+                folds = Geom::dotprod(n, Point(t.A, t.B, t.C)) <= 0;
+            }
+        }
+        if (folds) continue;
+
+        /* Collapse b into a */
+        if (splits) {
+            VertexSplit vs;
+            vs.kept = a;
+            vs.removed = b;
+            vs.keptPos = mVertices[a];
+            vs.newPos = p;
+            vs.triangles = live - shared.size();
+            vs.first = corners->size();
+            splits->push_back(vs);
+            removed->insert(removed->end(), shared.begin(), shared.end());
+        }
+        for (int i=0; i<shared.size(); ++i) {
+            Triangle &t = mTriangles[shared[i]];
+            t.deleted = 1;
+            for (int k=0; k<3; ++k)
+                if (t.v[k] != a && t.v[k] != b)
+                    adj.erase(t.v[k], shared[i]);
+            adj.erase(a, shared[i]);
+            adj.erase(b, shared[i]);
+            --live;
+        }
+        const int *tli;
+        for (tli = adj.begin(b); tli != adj.end(b); ++tli) {
+            Triangle &t = mTriangles[*tli];
+            for (int k=0; k<3; ++k) {
+                if (t.v[k] != b) continue;
+                t.v[k] = a;
+                if (corners) corners->push_back(3*(*tli)+k);
+            }
+        }
+        if (splits) splits->back().count = corners->size() - splits->back().first;
+        adj.merge(a, b);
+        mVertices[a] = p;
+        quad[a].add(quad[b]);
+        for (tli = adj.begin(a); tli != adj.end(a); ++tli)
+            mTriangles[*tli].update();
+
+        /* Move the edges of b to a. Those that a already has are dropped. */
+        ++stamp;
+        vector<int> &aEdges = vertexEdges[a];
+        aEdges.erase(find(aEdges.begin(), aEdges.end(), e));
+        for (int i=0; i<aEdges.size(); ++i) {
+            int ei = aEdges[i];
+            mark[edgeV[2*ei] == a ? edgeV[2*ei+1] : edgeV[2*ei]] = stamp;
+        }
+        for (int i=0; i<vertexEdges[b].size(); ++i) {
+            int ei = vertexEdges[b][i];
+            if (ei == e) continue;
+            int side = edgeV[2*ei] == b ? 0 : 1;
+            int w = edgeV[2*ei+1-side];
+            if (mark[w] == stamp) {
+                heap.remove(ei);
+                vector<int> &wEdges = vertexEdges[w];
+                wEdges.erase(find(wEdges.begin(), wEdges.end(), ei));
+                continue;
+            }
+            mark[w] = stamp;
+            edgeV[2*ei+side] = a;
+            aEdges.push_back(ei);
+        }
+        vertexEdges[b].clear();
 
-    updateTriangleData();
+        /* Only the edges of a have changed cost */
+        for (int i=0; i<aEdges.size(); ++i) {
+            int ei = aEdges[i];
+            int u = edgeV[2*ei], w = edgeV[2*ei+1];
+            heap.push(ei, collapseCost(quad, mVertices, u, w, edgeP[ei]));
+        }
+    }
 }
 
 void Mesh::setMaxSize(float size)
 {
-    float s = size / mAABB[0].getMaxSize();
+    float s = size / mAABB[0].box.getMaxSize();
+    clearProgressive();
 
     vector<Point>::iterator vi;
     for (vi=mVertices.begin(); vi!= mVertices.end(); ++vi)
@@ -614,37 +2011,44 @@ void Mesh::setMaxSize(float size)
     for(pi=mVoxels.begin(); pi!=mVoxels.end(); ++pi)
         pi->scale(s);
 
-    for (int bi=0; bi<BVL_SIZE(BVL); ++bi){
-        mAABB[bi].scale(s);
+    for (int bi=0; bi<mAABB.size(); ++bi)
+        mAABB[bi].box.scale(s);
+    for (int bi=0; bi<mNodeSpheres.size(); ++bi)
+        mNodeSpheres[bi].scale(s);
+    for (int bi=0; bi<BVL_SIZE(BVL); ++bi)
         mSphere[bi].scale(s);
-    }
 
     updateTriangleData();
+    ++mVersion;
 }
 
 void Mesh::cornerAlign()
 {
+    clearProgressive();
     vector<Point>::iterator vi;
     for (vi=mVertices.begin(); vi!= mVertices.end(); ++vi)
-        vi->sub(mAABB[0].min);
+        vi->sub(mAABB[0].box.min);
 
     vector<Box>::iterator pi;
     for(pi=mVoxels.begin(); pi!=mVoxels.end(); ++pi)
-        pi->sub(mAABB[0].min);
+        pi->sub(mAABB[0].box.min);
 
-    Point dl(mAABB[0].min);
-    for (int bi=0; bi<BVL_SIZE(BVL); ++bi) {
-        mAABB[bi].sub(dl);
+    Point dl(mAABB[0].box.min);
+    for (int bi=0; bi<mAABB.size(); ++bi)
+        mAABB[bi].box.sub(dl);
+    for (int bi=0; bi<mNodeSpheres.size(); ++bi)
+        mNodeSpheres[bi].sub(dl);
+    for (int bi=0; bi<BVL_SIZE(BVL); ++bi)
         mSphere[bi].sub(dl);
-    }
 
     updateTriangleData();
 }
 
 void Mesh::centerAlign()
 {
-    Point c2(mAABB[0].max);
-    Point c1(mAABB[0].min);
+    clearProgressive();
+    Point c2(mAABB[0].box.max);
+    Point c1(mAABB[0].box.min);
     c2.sub(c1);
     c2.scale(0.5);
     c1.add(c2);
@@ -657,16 +2061,207 @@ void Mesh::centerAlign()
     for(pi=mVoxels.begin(); pi!=mVoxels.end(); ++pi)
         pi->sub(c1);
 
-    for (int bi=0; bi<BVL_SIZE(BVL); ++bi){
-        mAABB[bi].sub(c1);
+    for (int bi=0; bi<mAABB.size(); ++bi)
+        mAABB[bi].box.sub(c1);
+    for (int bi=0; bi<mNodeSpheres.size(); ++bi)
+        mNodeSpheres[bi].sub(c1);
+    for (int bi=0; bi<BVL_SIZE(BVL); ++bi)
         mSphere[bi].sub(c1);
-    }
 
     updateTriangleData();
 }
 
 
+void Mesh::simplifyParallel(int target, float maxError, double deadline)
+{
+    int n = mTriangles.size();
+    int nv = mVertices.size();
+
+    /* The parts are the largest subtrees of the box hierarchy with at most
+     * SIMPLIFY_PART triangles. They do not depend on the number of threads,
+     * so neither does the result. A triangle in several leaves goes to the
+     * first part that reaches it. */
+    vector<int> refs(mAABB.size(), 0);
+    for (int bi=mAABB.size()-1; bi>=0; --bi) {
+        const BvhNode &node = mAABB[bi];
+        refs[bi] = node.isLeaf() ? node.count : refs[node.index]+refs[node.index+1];
+    }
+    vector<int> part(n, -1);
+    vector<vector<int> > partTris;
+    vector<int> stack(1, 0), sub;
+    while (!stack.empty()) {
+        int bi = stack.back();
+        stack.pop_back();
+        if (refs[bi] > SIMPLIFY_PART && !mAABB[bi].isLeaf()) {
+            stack.push_back(mAABB[bi].index+1);
+            stack.push_back(mAABB[bi].index);
+            continue;
+        }
+        vector<int> tris;
+        sub.assign(1, bi);
+        while (!sub.empty()) {
+            const BvhNode &node = mAABB[sub.back()];
+            sub.pop_back();
+            if (!node.isLeaf()) {
+                sub.push_back(node.index+1);
+                sub.push_back(node.index);
+                continue;
+            }
+            for (int i=node.index; i<node.index+node.count; ++i) {
+                int ti = mAABBIndices[i];
+                if (part[ti] >= 0 || mTriangles[ti].deleted) continue;
+                part[ti] = partTris.size();
+                tris.push_back(ti);
+            }
+        }
+        if (!tris.empty()) partTris.push_back(tris);
+    }
+
+    /* The vertices shared by two parts, or by a triangle outside
+     * all of them, stay where they are until the seams are done */
+    vector<int> owner(nv, -1);
+    vector<bool> locked(nv, false);
+    int live = 0;
+    for (int ti=0; ti<n; ++ti) {
+        if (mTriangles[ti].deleted) continue;
+        ++live;
+        for (int k=0; k<3; ++k) {
+            int v = mTriangles[ti].v[k];
+            if (part[ti] < 0 || (owner[v] >= 0 && owner[v] != part[ti])) locked[v] = true;
+            owner[v] = part[ti];
+        }
+    }
+
+    /* A small mesh for each part, with its own numbering of the vertices */
+    int np = partTris.size();
+    vector<Mesh> parts(np);
+    vector<vector<int> > partVerts(np);
+    vector<vector<bool> > partLocked(np);
+    vector<int> local(nv, -1), localPart(nv, -1);
+    for (int p=0; p<np; ++p) {
+        Mesh &m = parts[p];
+        for (int i=0; i<partTris[p].size(); ++i) {
+            const Triangle &t = mTriangles[partTris[p][i]];
+            int lv[3];
+            for (int k=0; k<3; ++k) {
+                int v = t.v[k];
+                if (localPart[v] != p) {
+                    localPart[v] = p;
+                    local[v] = partVerts[p].size();
+                    partVerts[p].push_back(v);
+                    partLocked[p].push_back(locked[v]);
+                    m.mVertices.push_back(mVertices[v]);
+                }
+                lv[k] = local[v];
+            }
+            m.mTriangles.push_back(Triangle(&m.mVertices, lv[0], lv[1], lv[2]));
+        }
+    }
+
+    /* Each part collapses its inside to its share of the target. The
+     * parts own their triangles and inside vertices, so they write them
+     * back at the same time. */
+    Parallel::steal(np, [&](int p) {
+        Mesh &m = parts[p];
+        int share = (long long)partTris[p].size()*target/live;
+        m.simplifyQuadric(share, maxError, deadline, &partLocked[p]);
+
+        for (int i=0; i<m.mTriangles.size(); ++i) {
+            Triangle &t = mTriangles[partTris[p][i]];
+            if (m.mTriangles[i].deleted) {
+                t.deleted = 1;
+                continue;
+            }
+            for (int k=0; k<3; ++k)
+                t.v[k] = partVerts[p][m.mTriangles[i].v[k]];
+        }
+        for (int lv=0; lv<partVerts[p].size(); ++lv)
+            if (!partLocked[p][lv]) mVertices[partVerts[p][lv]] = m.mVertices[lv];
+    });
+
+    /* The seams, and whatever the parts could not reach, in one serial pass */
+    for (int ti=0; ti<n; ++ti)
+        if (!mTriangles[ti].deleted) mTriangles[ti].update();
+    simplifyQuadric(target, maxError, deadline);
+}
+
+/* Progressive mesh */
+void Mesh::createProgressive()
+{
+    clock_t t = clock();
+
+    /* Collapse a copy of the mesh as far as it goes, recording every step */
+    vector<int> removed;
+    clearProgressive();
+    Mesh work(*this);
+    work.simplifyQuadric(0, 0, 0, NULL, &mSplits, &mSplitCorners, &removed);
+
+    /* Order the triangles so that those never removed come first, then
+     * the removed ones from the last to the first. The triangles of any
+     * level are then a prefix of the list. */
+    int n = mTriangles.size();
+    vector<int> order(n, -1);
+    int pos = n;
+    for (int i=0; i<(int)removed.size(); ++i)
+        order[removed[i]] = --pos;
+    pos = 0;
+    for (int ti=0; ti<n; ++ti)
+        if (order[ti] < 0) order[ti] = pos++;
+
+    mLodIndices.resize(3*n);
+    for (int ti=0; ti<n; ++ti)
+        for (int k=0; k<3; ++k)
+            mLodIndices[3*order[ti]+k] = mTriangles[ti].v[k];
+    for (int c=0; c<mSplitCorners.size(); ++c)
+        mSplitCorners[c] = 3*order[mSplitCorners[c]/3] + mSplitCorners[c]%3;
+    mLodVertices = mVertices;
+    mLodLevel = 0;
+
+    printf ("Progressive mesh took:\t%4.2f sec | %d collapses | %d to %d triangles \n",
+            ((float)clock()-t)/CLOCKS_PER_SEC, (int)mSplits.size(), n,
+            mSplits.empty() ? n : mSplits.back().triangles);
+}
+
+void Mesh::clearProgressive()
+{
+    mSplits.clear();
+    mSplitCorners.clear();
+    mLodIndices.clear();
+    mLodVertices.clear();
+    mLodLevel = 0;
+}
+
+void Mesh::setLodTriangles(int triangles)
+{
+    /* Each step is one collapse or one vertex split, so the cost is
+     * proportional to the distance between the two levels. */
+    while (mLodLevel > 0 && (mLodLevel > 1 ? mSplits[mLodLevel-2].triangles : (int)mLodIndices.size()/3) <= triangles) {
+        const VertexSplit &vs = mSplits[--mLodLevel];
+        for (int c=vs.first; c<vs.first+vs.count; ++c)
+            mLodIndices[mSplitCorners[c]] = vs.removed;
+        mLodVertices[vs.kept] = vs.keptPos;
+    }
+    while (mLodLevel < mSplits.size() && getLodTriangles() > triangles) {
+        const VertexSplit &vs = mSplits[mLodLevel++];
+        for (int c=vs.first; c<vs.first+vs.count; ++c)
+            mLodIndices[mSplitCorners[c]] = vs.kept;
+        mLodVertices[vs.kept] = vs.newPos;
+    }
+}
+
+int Mesh::getLodTriangles() const
+{
+    return mLodLevel ? mSplits[mLodLevel-1].triangles : mLodIndices.size()/3;
+}
+
+
 /* Drawing */
+void Mesh::prepareVoxels()
+{
+    if (!mVoxelsReady)
+        createVoxels();
+}
+
 void Mesh::drawVoxels(Colour col)
 {
     vector<Box>::const_iterator pi;
@@ -694,6 +2289,26 @@ void Mesh::drawTriangles(Colour col, bool wire)
     glEnd();
 }
 
+void Mesh::drawLod(Colour col, bool wire)
+{
+    /* The vertices move with the level, so the triangles get flat normals */
+    glPolygonMode(GL_FRONT_AND_BACK, wire? GL_LINE: GL_FILL);
+    glBegin(GL_TRIANGLES);
+    glColor3ubv(col.data);
+    int n = 3*getLodTriangles();
+    for (int i=0; i<n; i+=3) {
+        const Point &v1 = mLodVertices[mLodIndices[i]];
+        const Point &v2 = mLodVertices[mLodIndices[i+1]];
+        const Point &v3 = mLodVertices[mLodIndices[i+2]];
+        Point normal = Geom::crossprod(Point(v2).sub(v1), Point(v3).sub(v1));
+        glNormal3fv(normal.data);
+        glVertex3fv(v1.data);
+        glVertex3fv(v2.data);
+        glVertex3fv(v3.data);
+    }
+    glEnd();
+}
+
 void Mesh::drawTriangleBoxes(Colour col)
 {
     vector<Triangle>::const_iterator ti;
@@ -740,12 +2355,13 @@ void Mesh::drawAABB(Colour col, bool hier)
     /* Draw only the main box and the
      * leaves of the tree (last level of hierarchy */
     if (!hier) {
-        mAABB[0].draw(col, 0);
+        mAABB[0].box.draw(col, 0);
     }
     else {
-        for (int bi=BVL_SIZE(BVL-1); bi<BVL_SIZE(BVL); ++bi) {
-            mAABB[bi].draw(col, 0);
-            mAABB[bi].draw(col, 0x50);
+        for (int bi=0; bi<mAABB.size(); ++bi) {
+            if (!mAABB[bi].isLeaf()) continue;
+            mAABB[bi].box.draw(col, 0);
+            mAABB[bi].box.draw(col, 0x50);
         }
     }
 }
@@ -758,8 +2374,8 @@ void Mesh::draw(Colour col, int x)
     glRotatef(mRot.y, 0, 1, 0);
     glRotatef(mRot.z, 0, 0, 1);
     if (x & VOXELS) drawVoxels(Colour(0,0xFF,0));
-    if (x & SOLID) drawTriangles(col, false);
-    if (x & WIRE) drawTriangles(Colour(0,0,0), true);
+    if (x & SOLID) hasProgressive() ? drawLod(col, false) : drawTriangles(col, false);
+    if (x & WIRE) hasProgressive() ? drawLod(Colour(0,0,0), true) : drawTriangles(Colour(0,0,0), true);
     if (x & NORMALS) drawNormals(col);
     if (x & AABB) drawAABB(Colour(0xA5, 0x2A, 0x2A), x&HIER);
     if (x & SPHERE) drawSphere(Colour(0xA5, 0x2A, 0x2A), x&HIER);
@@ -7,9 +7,9 @@
 
 #include <vector>
 #include <string>
-#include <list>
 #include <set>
 #include "geom.h"
+#include "adjacency.h"
 
 #ifdef __linux__
 #include <GL/glut.h>
@@ -20,40 +20,232 @@
 using namespace std;
 
 #define BVL_SIZE(L) ((1<<((L)+1))-1)            ///< MACRO giving the total number of nodes in a hierarchy tree with L levels
-#define BVL     7                               ///< Number of levels of hierarchy of bounding volumes
+#define BVL     7                               ///< Number of levels of the sphere hierarchy and of the coverage statistics
 #define VDIV    50                              ///< Number of divisions for volume scanning
+#define LEAF_SIZE 8                             ///< Default number of triangles at or below which a box is not split
+#define MAX_DEPTH 32                            ///< Default maximum depth of the box hierarchy
+#define REFIT_LIMIT 1.2                         ///< Growth of the SAH cost after which a refitted box hierarchy is rebuilt
+#define SIMPLIFY_PART 4096                      ///< Largest number of triangles of a part of a parallel simplification
+
+/**
+ * Methods used to estimate the volume of a mesh.
+ */
+enum VolumeMode {
+    VOLUME_RAYS,        ///< Cast one ray per voxel
+    VOLUME_SCANLINE,    ///< Cast one ray per column of voxels and fill the inside spans by parity
+    VOLUME_EXACT        ///< Sum signed tetrahedra. Falls back to VOLUME_SCANLINE for open meshes.
+};
+
+/**
+ * Methods used to split the nodes of the bounding box hierarchy.
+ */
+enum BvhBuilder {
+    BVH_MIDPOINT,       ///< Split the longest side in the middle. Triangles on the split go to both children.
+    BVH_SAH,            ///< Binned surface area heuristic. Every triangle goes to exactly one child.
+    BVH_LBVH            ///< Split the triangles sorted by the Morton code of their centres. Fast for very large meshes.
+};
+
+/**
+ * Bounding volumes used to cull the node pairs of a mesh intersection.
+ */
+enum CollisionMode {
+    COLLIDE_BOXES,      ///< Boxes of the box hierarchy. Boxes of the second mesh are re-boxed in the frame of the first.
+    COLLIDE_SPHERES,    ///< Spheres of the sphere hierarchy, which do not change with rotation
+    COLLIDE_HYBRID      ///< Box hierarchy, with the box or the sphere of each node, whichever has the smaller volume
+};
+
+/**
+ * Methods used to choose and place the edge collapses of a simplification.
+ */
+enum SimplifyEngine {
+    SIMPLIFY_NORMALS,   ///< Collapse triangles by how much the normals around their first vertex vary, to the edge midpoint
+    SIMPLIFY_QUADRIC    ///< Collapse the edge of the least quadric error, to the point that minimizes it (Garland-Heckbert)
+};
+
+/**
+ * Parameters of a simplification. It stops at whichever budget runs out first.
+ */
+struct SimplifyOptions {
+    SimplifyEngine engine;  ///< Method used for the collapses
+    int percent;            ///< Percentage of the triangles to keep
+    int triangles;          ///< Number of triangles to keep. Overrides percent when positive.
+    float maxError;         ///< Largest quadric error of a collapse, in squared units of the mesh. Unlimited when 0. SIMPLIFY_QUADRIC only.
+    float seconds;          ///< Time given to the collapses. Unlimited when 0.
+    bool parallel;          ///< Collapse the inside of parts of the mesh on all threads, then the seams. SIMPLIFY_QUADRIC only.
+
+    SimplifyOptions(int _percent=1):
+        engine(SIMPLIFY_NORMALS),
+        percent(_percent),
+        triangles(0),
+        maxError(0),
+        seconds(0),
+        parallel(false)
+    {
+    }
+};
+
+/**
+ * One edge collapse of a progressive mesh. Played backwards it is
+ * the vertex split that undoes the collapse.
+ */
+struct VertexSplit {
+    int kept;               ///< Vertex that stays, moved to newPos
+    int removed;            ///< Vertex that goes, merged into kept
+    Point keptPos;          ///< Position of kept before the collapse
+    Point newPos;           ///< Position of kept after the collapse
+    int triangles;          ///< Triangles left after the collapse
+    int first;              ///< First corner moved from removed to kept, in the corner list of the mesh
+    int count;              ///< Number of corners moved
+};
+
+/**
+ * Parameters that control the preprocessing of a mesh.
+ */
+struct MeshOptions {
+    VolumeMode volumeMode;  ///< Method used for the volume estimation
+    int volumeDivs;         ///< Number of divisions for volume scanning
+    BvhBuilder bvhBuilder;  ///< Method used to build the bounding box hierarchy
+    int leafSize;           ///< Nodes with this many triangles or fewer are not split
+    int maxDepth;           ///< Maximum depth of the bounding box hierarchy
+    bool exactSplit;        ///< Put a triangle in a child of a midpoint split only if the triangle itself touches the child
+
+    MeshOptions():
+        volumeMode(VOLUME_EXACT),
+        volumeDivs(VDIV),
+        bvhBuilder(BVH_SAH),
+        leafSize(LEAF_SIZE),
+        maxDepth(MAX_DEPTH),
+        exactSplit(false)
+    {
+    }
+};
+
+/**
+ * Node of the bounding box hierarchy, 32 bytes.
+ *
+ * An inner node has count 0 and its children at index and index+1.
+ * A leaf has its triangles at [index, index+count) of the index array
+ * of the mesh. An empty leaf has both set to 0.
+ */
+struct BvhNode {
+    Box box;                ///< Box of the node
+    int index;              ///< First child, or first triangle of a leaf
+    int count;              ///< Triangles of a leaf, 0 for inner nodes
+
+    BvhNode(): index(0), count(0) {}
+    bool isLeaf() const { return count > 0 || index == 0; }
+};
+
+/**
+ * Quality measures of a bounding box hierarchy.
+ */
+struct BvhStats {
+    float sahCost;          ///< Expected cost of a query, with unit cost per node and per triangle
+    float avgLeafSize;      ///< Average number of triangles in the non empty leaves
+    float duplication;      ///< Triangle references in the leaves per triangle of the mesh
+    float levelDuplication[BVL+1]; ///< Triangle references per triangle of the mesh at each level. Leaves above a level count in it.
+};
+
+/**
+ * Counters of the work done by one mesh intersection.
+ */
+struct CollisionStats {
+    unsigned long nodePairs;        ///< Pairs of hierarchy nodes whose volumes were tested
+    unsigned long boxTests;         ///< Node pairs tested box against box
+    unsigned long sphereTests;      ///< Node pairs tested sphere against sphere
+    unsigned long mixedTests;       ///< Node pairs tested box against sphere
+    unsigned long culledPairs;      ///< Node pairs whose volumes did not overlap
+    unsigned long leafPairs;        ///< Pairs of overlapping leaves, whose triangles were tested
+    unsigned long trianglePairs;    ///< Pairs of triangles that were tested
+
+    CollisionStats():
+        nodePairs(0),
+        boxTests(0),
+        sphereTests(0),
+        mixedTests(0),
+        culledPairs(0),
+        leafPairs(0),
+        trianglePairs(0)
+    {
+    }
+};
 
 /**
  * Class that handles a model.
  */
 class Mesh
 {
+    friend class Bench;
+
     /** Data members */
     vector<Point> mVertices;                    ///< Vertex list
     vector<Triangle> mTriangles;                ///< Triangle list | contains indices to the Vertex list
     vector<Point> mVertexNormals;               ///< Normals per vertex
-    vector<set<int> > mVertexTriangles;         ///< List of lists of the triangles that are connected to each vertex
-    vector<list<int> > mAABBTriangles;          ///< Triangles of each AABB hierarchy level
-    vector<list<int > > mSphereTriangles;       ///< Triangles of each Sphere hierarchy level
-    vector<Box> mAABB;                          ///< The bounding box hierarchy of the model
+    Adjacency mVertexTriangles;                 ///< List of lists of the triangles that are connected to each vertex
+    vector<int> mSphereOffsets;                 ///< Start of the triangles of each node of the sphere hierarchy, and the end of the last
+    vector<int> mSphereIndices;                 ///< Triangles of the nodes of the sphere hierarchy, one node after the other
+    vector<BvhNode> mAABB;                      ///< The bounding box hierarchy of the model. The root is first.
+    vector<int> mAABBIndices;                   ///< Triangles of the leaves of the box hierarchy, one leaf after the other in node order
+    vector<Sphere> mNodeSpheres;                ///< Bounding sphere of each node of the box hierarchy, for COLLIDE_HYBRID
     vector<Sphere> mSphere;                     ///< The bounding sphere hierarchy of the model
     vector<Box> mVoxels;                        ///< The voxels that are generated during the volume calculation
+    bool mVoxelsReady;                          ///< The voxels have been scanned, even if none were found
     float AABBCover[BVL+1];                     ///< Bounding box coverage of each hierarchy level
     float sphereCover[BVL+1];                   ///< Bounding sphere coverage of each hierarchy level
     Point mRot;                                 ///< Model rotation around its local axis
     Point mPos;                                 ///< Model position in the scene
+    MeshOptions mOpt;                           ///< Parameters of the preprocessing
+    CollisionStats mCollisionStats;             ///< Work done to create this mesh from an intersection
+    float mBvhCost;                             ///< SAH cost of the box hierarchy when it was last built
+    vector<VertexSplit> mSplits;                ///< Collapses of the progressive mesh, in order. Empty without one.
+    vector<int> mSplitCorners;                  ///< Corners (3*triangle+k) moved by each collapse, one collapse after the other
+    vector<int> mLodIndices;                    ///< Vertex indices of the triangles of the progressive mesh, the last removed first
+    vector<Point> mLodVertices;                 ///< Vertices of the progressive mesh at the current level
+    int mLodLevel;                              ///< Number of collapses applied to the progressive mesh
+    int mId;                                    ///< Unique identifier, never reused by another mesh
+    int mVersion;                               ///< Incremented whenever the geometry of the mesh changes
+    static int nextId;                          ///< Identifier of the next mesh to be created
 
     /** Private methods */
     void createTriangleLists ();                ///< Create lists with each vertex's triangles
     void createBoundingVolHierarchy ();         ///< Creates BVL levels of hierarchy of bounding volumes
-    void createBoundingBoxHierarchy ();         ///< Creates BVL levels of hierarchy of bounding boxes
+    void createBoundingBoxHierarchy ();         ///< Creates the hierarchy of bounding boxes, down to mOpt.leafSize triangles
     void createBoundingSphereHierarchy ();      ///< Creates BVL levels of hierarchy of bounding spheres
+    Sphere fitSphere (const int *tris,          ///< Smallest sphere of the vertices of some triangles
+        int count, vector<int> &mark, int stamp, vector<int> &verts) const;
+    void fitNodeSpheres ();                     ///< Fit a sphere to every node of the box hierarchy
+    void leafTriangles (int node,               ///< Append the triangles of a leaf of the hierarchy that mode uses
+        CollisionMode mode, vector<int> &out) const;
+    void simplifyNormals (int target,           ///< Collapse edges with SIMPLIFY_NORMALS until target triangles are left
+        double deadline);
+    void simplifyQuadric (int target,           ///< Collapse edges with SIMPLIFY_QUADRIC until target triangles are left. Can record the collapses.
+        float maxError, double deadline, const vector<bool> *locked=NULL, vector<VertexSplit> *splits=NULL,
+        vector<int> *corners=NULL, vector<int> *removed=NULL);
+    void simplifyParallel (int target,          ///< Simplify the parts of the box hierarchy at the same time with their borders locked, then the whole mesh
+        float maxError, double deadline);
+    void drawLod (Colour col, bool wire=0);     ///< Draw the progressive mesh at its current level
+    void createMortonHierarchy ();              ///< Creates the box hierarchy from the Morton order of the triangles
+    void splitNodes (vector<BvhNode> &nodes,    ///< Split the nodes on the stack and their children, leaving the small ones in pending
+        vector<vector<int> > &tris, vector<pair<int,int> > &stack, int minSplit, vector<pair<int,int> > *pending) const;
+    void splitMidpoint (const Box &box,         ///< Divide the triangles of a box in the middle of its longest side
+        const vector<int> &in, vector<int> &left, vector<int> &right, Box &boxL, Box &boxR) const;
+    void splitSAH (const Box &box,              ///< Divide the triangles of a box with the surface area heuristic
+        const vector<int> &in, vector<int> &left, vector<int> &right, Box &boxL, Box &boxR) const;
+    void boxDepths (vector<int> &depth) const;  ///< Find the depth of every node of the box hierarchy
+    void refitBoundingVolHierarchy (            ///< Renumber the triangles of both hierarchies and fit the volumes to them
+        const vector<int> &newIndex);
     void updateTriangleData ();                 ///< Recalculates the plane equations of the triangles
-    void calculateVolume ();                    ///< Estimate the volume of the mesh by scanning all the bounding box
+    void calculateVolume ();                    ///< Find the volume of the mesh and the coverage of the hierarchies
+    float createVoxels ();                      ///< Scan the bounding box for inside voxels and return the volume they cover
+    bool isWatertight ();                       ///< Check that every edge is shared by two opposite triangles
+    float exactVolume ();                       ///< Volume of a closed mesh as a sum of signed tetrahedra
+    unsigned long scanVolumeRays (              ///< Count the inside voxels with one ray per voxel
+        const vector<float> &xs, const vector<float> &ys, const vector<float> &zs, float dl);
+    unsigned long scanVolumeColumns (           ///< Count the inside voxels with one ray per column of voxels
+        const vector<float> &xs, const vector<float> &ys, const vector<float> &zs, float dl);
     void cornerAlign ();                        ///< Align the mesh to the corner of each local axis
     void centerAlign ();                        ///< Align the mesh to the center of each local axis
     void createNormals ();                      ///< Create a normal for each vertex
-    void hardTranslate (const Point &p);        ///< Translation by adding the displacement to the vertices
 
     void drawTriangles (Colour col,bool wire=0);///< Draw the triangles. This is the actual model drawing.
     void drawSphere (Colour col, bool hier=0);  ///< Draw the boundig sphere of the model
@@ -65,28 +257,56 @@ class Mesh
     static void loadObj (string filename,       ///< Populate vertex | triangle lists from file
         vector<Point> &vertices, vector<Triangle> &triangles, bool ccw=0);
 
-    static void intersect (Mesh &m1,  Mesh &m2, ///< Populate vertex | triangle lists with collisions of two other meshes */
-        vector<Point> &vertices, vector<Triangle> &triangles, bool both=0);
+    static unsigned long long cacheKey (        ///< Hash of an .obj file and of the loading parameters
+        string filename, bool ccw, const MeshOptions &opt);
+    bool readCache (string cachename,           ///< Load all the preprocessed data from a cache file
+        unsigned long long key);
+    void writeCache (string cachename,          ///< Save all the preprocessed data to a cache file
+        unsigned long long key);
+
+    static void intersect (const Mesh &m1,      ///< Populate vertex | triangle lists with collisions of two other meshes */
+        const Mesh &m2, vector<Point> &vertices, vector<Triangle> &triangles, bool both=0,
+        CollisionStats *stats=NULL, CollisionMode mode=COLLIDE_BOXES);
+    static void intersect (const Mesh &m1,      ///< Same as above, with the meshes placed by tr1 and tr2. Output is in the frame of m1.
+        const Transform &tr1, const Mesh &m2, const Transform &tr2,
+        vector<Point> &vertices, vector<Triangle> &triangles, bool both=0,
+        CollisionStats *stats=NULL, CollisionMode mode=COLLIDE_BOXES);
 
 public:
     Mesh ();
-    Mesh (string filename, bool ccw=0);         ///< Constructor from .obj file
-    Mesh (Mesh &m1,  Mesh &m2, bool both=0);    ///< Constructor from intersection of other models
+    Mesh (string filename, bool ccw=0,          ///< Constructor from .obj file
+        const MeshOptions &opt=MeshOptions());
+    Mesh (const Mesh &m1, const Mesh &m2,       ///< Constructor from intersection of other models. It is placed like m1.
+        bool both=0, CollisionMode mode=COLLIDE_BOXES);
     Mesh (const Mesh &original);                ///< Copy constructor
    ~Mesh (void);                                ///< Destructor
 
     void draw (Colour col, int style);          ///< Draw the mesh with the specified style
     void simplify (int percent=1);              ///< Try to reduce the number of faces preserving the shape
+    void simplify (const SimplifyOptions &opt); ///< Same as above, with a choice of engine and budgets
+    void createProgressive ();                  ///< Record all the quadric collapses of the mesh as a progressive mesh, drawn instead of the mesh
+    void clearProgressive ();                   ///< Drop the progressive mesh and draw the mesh itself again
+    void prepareVoxels ();                      ///< Scan the voxels for drawing, unless they have been scanned already
+    bool hasProgressive () const { return !mSplits.empty();}    ///< Check whether the mesh has a progressive mesh
+    void setLodTriangles (int triangles);       ///< Move the progressive mesh to the finest level with at most this many triangles
+    int getLodTriangles () const;               ///< Get the number of triangles of the progressive mesh at its current level
     void setMaxSize (float size);               ///< Set the meshes size according to the max size of three (x|y|z)
     void move (Point &p) { mPos.add(p);}        ///< Move the mesh in the world.
     void rotate (Point &p) { mRot.add(p);}      ///< Rotate mesh around its local axis
     void setPos (Point &p) { mPos = p;}         ///< Set the position of the mesh
     void setRot (Point &p) {mRot = p;}          ///< Set the rotation of the mesh
-    const Box &getBox () { return mAABB[0];}    ///< Get the bounding box
+    const Box &getBox () { return mAABB[0].box;}    ///< Get the bounding box
+    int getTriangleCount () { return mTriangles.size();}    ///< Get the number of triangles
     const Point &getPos() { return mPos;}       ///< Get the position
     const Point &getLocalRot() { return mRot;}  ///< Get the rotation
+    Transform getTransform() const { return Transform(mPos, mRot);} ///< Get the transformation that places the mesh in the world
+    Box getWorldBox() const { return getTransform().apply(mAABB[0].box);} ///< Get a box that contains the mesh as placed in the world
     float getAABBCoverage(int l) { return AABBCover[l];}        ///< Get the percentage of coverage for a specific level of the box hierarchy
     float getSphereCoverage(int l) { return sphereCover[l];}    ///< Get the percentage of coverage for a specific level of the sphere hierarchy
+    BvhStats getBvhStats () const;              ///< Measure the quality of the bounding box hierarchy
+    const CollisionStats &getCollisionStats() { return mCollisionStats;} ///< Get the work done by the intersection that created this mesh
+    int getId() const { return mId;}            ///< Get the unique identifier of the mesh
+    int getVersion() const { return mVersion;}  ///< Get the version of the geometry of the mesh
 
 };
 
@@ -0,0 +1,507 @@
+/** @file meshio.cpp
+ * Loading and caching of class Mesh from files.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include "mesh.h"
+#include "parallel.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Read-only view of the contents of a file.
+ *
+ * On linux the file is memory mapped. Elsewhere it is read in a buffer.
+ */
+struct MappedFile {
+    const char *data;   ///< The contents of the file
+    size_t size;        ///< The size of the file in bytes
+
+    MappedFile(): data(NULL), size(0), mapped(false) {}
+
+    ~MappedFile() { close(); }
+
+    bool open(const string &filename) {
+        close();
+#ifdef __linux__
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = (const char*) p;
+                size = st.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if (mapped) return true;
+#endif
+        FILE *file = fopen(filename.c_str(), "rb");
+        if (!file) return false;
+        fseek(file, 0, SEEK_END);
+        long len = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (len > 0) {
+            char *buf = (char*) malloc(len);
+            if (!buf) {
+                fclose(file);
+                return false;
+            }
+            size = fread(buf, 1, len, file);
+            data = buf;
+        }
+        fclose(file);
+        return true;
+    }
+
+    void close() {
+#ifdef __linux__
+        if (mapped) munmap((void*) data, size);
+#endif
+        if (!mapped) free((void*) data);
+        data = NULL;
+        size = 0;
+        mapped = false;
+    }
+
+private:
+    bool mapped;
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+};
+
+/**
+ * Vertices and faces of one chunk of an .obj file.
+ */
+struct ObjChunk {
+    const char *begin;          ///< First character of the chunk
+    const char *end;            ///< One past the last character of the chunk
+    vector<Point> vertices;     ///< Vertices found in the chunk
+    vector<int> faces;          ///< Vertex indices of the faces found in the chunk, 3 per triangle
+    vector<int> relative;       ///< Positions in faces that hold indices relative to the chunk's first vertex
+};
+
+static inline bool isBlank(char c) { return c==' ' || c=='\t' || c=='\r'; }
+
+static inline const char *skipBlanks(const char *s, const char *end)
+{
+    while (s < end && isBlank(*s)) ++s;
+    return s;
+}
+
+/**
+ * Parses a decimal floating point number.
+ * @return Pointer past the number, or s if no number was found.
+ */
+static const char *scanFloat(const char *s, const char *end, float &out)
+{
+    static const double pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *p = s;
+    bool neg = false;
+    if (p < end && (*p=='-' || *p=='+')) neg = (*p++ == '-');
+
+    unsigned long long mant = 0;
+    int exp = 0, digits = 0;
+    for (; p < end && *p>='0' && *p<='9'; ++p, ++digits) {
+        if (mant < 100000000000000000ULL) mant = mant*10 + (*p-'0');
+        else ++exp;
+    }
+    if (p < end && *p=='.') {
+        for (++p; p < end && *p>='0' && *p<='9'; ++p, ++digits) {
+            if (mant < 100000000000000000ULL) { mant = mant*10 + (*p-'0'); --exp; }
+        }
+    }
+    if (!digits) return s;
+
+    if (p < end && (*p=='e' || *p=='E')) {
+        const char *q = p+1;
+        bool eneg = false;
+        if (q < end && (*q=='-' || *q=='+')) eneg = (*q++ == '-');
+        if (q < end && *q>='0' && *q<='9') {
+            int e = 0;
+            for (; q < end && *q>='0' && *q<='9'; ++q) if (e < 1000) e = e*10 + (*q-'0');
+            exp += eneg? -e: e;
+            p = q;
+        }
+    }
+
+    double v = (double) mant;
+    while (exp > 22)  { v *= 1e22; exp -= 22; }
+    while (exp < -22) { v /= 1e22; exp += 22; }
+    v = exp<0? v/pow10[-exp]: v*pow10[exp];
+    out = (float) (neg? -v: v);
+    return p;
+}
+
+/**
+ * Parses a decimal integer.
+ * @return Pointer past the number, or s if no number was found.
+ */
+static const char *scanInt(const char *s, const char *end, int &out)
+{
+    const char *p = s;
+    bool neg = false;
+    if (p < end && (*p=='-' || *p=='+')) neg = (*p++ == '-');
+    if (p == end || *p<'0' || *p>'9') return s;
+    int v = 0;
+    for (; p < end && *p>='0' && *p<='9'; ++p) v = v*10 + (*p-'0');
+    out = neg? -v: v;
+    return p;
+}
+
+/**
+ * Parses the 'v' and 'f' lines of a chunk. Polygons are split to triangle fans.
+ * Face indices are stored 0-based. Negative (relative) indices are stored
+ * relative to the first vertex of the chunk and recorded in chunk.relative.
+ */
+static void parseObjChunk(ObjChunk &chunk, bool ccw)
+{
+    const char *s = chunk.begin, *end = chunk.end;
+    vector<pair<int,bool> > poly;
+
+    while (s < end) {
+        const char *eol = s;
+        while (eol < end && *eol != '\n') ++eol;
+        s = skipBlanks(s, eol);
+
+        if (eol-s > 1 && s[0]=='v' && isBlank(s[1])) {
+            Point v;
+            const char *p = s+1;
+            for (int i=0; i<3; ++i) {
+                p = skipBlanks(p, eol);
+                p = scanFloat(p, eol, v.data[i]);
+            }
+            chunk.vertices.push_back(v);
+        }
+        else if (eol-s > 1 && s[0]=='f' && isBlank(s[1])) {
+            poly.clear();
+            const char *p = s+1;
+            for (;;) {
+                int idx;
+                p = skipBlanks(p, eol);
+                const char *q = scanInt(p, eol, idx);
+                if (q == p) break;
+                /* Skip texture/normal indices of v/vt/vn */
+                while (q < eol && !isBlank(*q)) ++q;
+                p = q;
+                if (idx < 0) poly.push_back(make_pair((int)chunk.vertices.size()+idx, true));
+                else poly.push_back(make_pair(idx-1, false));
+            }
+            for (int i=2; i<poly.size(); ++i) {
+                pair<int,bool> f[3] = {poly[0], poly[i-1], poly[i]};
+                if (ccw) swap(f[1], f[2]);
+                for (int k=0; k<3; ++k) {
+                    if (f[k].second) chunk.relative.push_back(chunk.faces.size());
+                    chunk.faces.push_back(f[k].first);
+                }
+            }
+        }
+
+        s = eol+1;
+    }
+}
+
+void Mesh::loadObj(string filename, vector<Point> &vertices, vector<Triangle> &triangles, bool ccw)
+{
+    double t = Parallel::seconds();
+    MappedFile file;
+    if (!file.open(filename)) return;
+
+    /* Split the file in chunks on line boundaries */
+    const size_t minChunk = 1<<16;
+    int nchunks = std::max(1, std::min((int)(file.size/minChunk), 4*Parallel::threadCount()));
+    vector<ObjChunk> chunks(nchunks);
+    const char *pos = file.data, *end = file.data + file.size;
+    for (int c=0; c<nchunks; ++c) {
+        const char *cend = (c==nchunks-1)? end: file.data + file.size*(c+1)/nchunks;
+        if (cend < pos) cend = pos;
+        while (cend < end && *cend != '\n') ++cend;
+        if (cend < end) ++cend;
+        chunks[c].begin = pos;
+        chunks[c].end = cend;
+        pos = cend;
+    }
+
+    Parallel::run(nchunks, [&](int c) { parseObjChunk(chunks[c], ccw); });
+
+    /* Find where each chunk goes in the final arrays */
+    vector<size_t> vbase(nchunks+1, vertices.size()), fbase(nchunks+1, 0);
+    for (int c=0; c<nchunks; ++c) {
+        vbase[c+1] = vbase[c] + chunks[c].vertices.size();
+        fbase[c+1] = fbase[c] + chunks[c].faces.size();
+    }
+
+    /* Resolve relative indices to absolute ones */
+    Parallel::run(nchunks, [&](int c) {
+        ObjChunk &ch = chunks[c];
+        for (int i=0; i<ch.relative.size(); ++i)
+            ch.faces[ch.relative[i]] += vbase[c];
+    });
+
+    /* Merge the chunks in file order */
+    vertices.resize(vbase[nchunks]);
+    Parallel::run(nchunks, [&](int c) {
+        std::copy(chunks[c].vertices.begin(), chunks[c].vertices.end(), vertices.begin()+vbase[c]);
+    });
+
+    if (vertices.empty()) return;
+
+    vector<int> faces(fbase[nchunks]);
+    Parallel::run(nchunks, [&](int c) {
+        std::copy(chunks[c].faces.begin(), chunks[c].faces.end(), faces.begin()+fbase[c]);
+    });
+
+    /* Drop the faces that point outside the vertex list */
+    size_t nv = vertices.size(), nf = 0;
+    for (size_t f=0; f<faces.size(); f+=3) {
+        if (faces[f]<0 || faces[f]>=nv || faces[f+1]<0 || faces[f+1]>=nv || faces[f+2]<0 || faces[f+2]>=nv)
+            continue;
+        faces[nf++] = faces[f];
+        faces[nf++] = faces[f+1];
+        faces[nf++] = faces[f+2];
+    }
+    nf /= 3;
+
+    size_t tbase = triangles.size();
+    triangles.resize(tbase+nf, Triangle(&vertices, 0, 0, 0));
+    const int block = 4096;
+    Parallel::run((nf+block-1)/block, [&](int b) {
+        size_t last = std::min(nf, (size_t)(b+1)*block);
+        for (size_t f=(size_t)b*block; f<last; ++f)
+            triangles[tbase+f] = Triangle(&vertices, faces[3*f], faces[3*f+1], faces[3*f+2]);
+    });
+
+    t = Parallel::seconds()-t;
+    if (t <= 0) t = 1e-9;
+    printf ("Obj parsing took:\t%4.2f sec | %.1f MB/s | %.0f faces/s | %d threads \n",
+            t, file.size/t/(1<<20), nf/t, Parallel::threadCount());
+}
+
+
+/* Binary cache */
+
+static const char CACHE_MAGIC[4] = {'G','P','M','C'};
+static const unsigned int CACHE_VERSION = 4;
+
+/**
+ * Header of a mesh cache file. The arrays follow in the order of the fields
+ * that give their sizes, each one packed with no padding.
+ */
+struct CacheHeader {
+    char magic[4];              ///< Always CACHE_MAGIC
+    unsigned int version;       ///< Format version, always CACHE_VERSION
+    unsigned long long key;     ///< Hash of the .obj contents and of the loading parameters
+    int levels;                 ///< Levels of the sphere hierarchy (BVL) the file was written with
+    int vertices;               ///< Number of vertices (and vertex normals)
+    int triangles;              ///< Number of triangles
+    int aabbNodes;              ///< Number of nodes in the AABB hierarchy
+    int sphereNodes;            ///< Number of nodes in the sphere hierarchy
+    int aabbIndices;            ///< Length of the AABB leaf index array
+    int sphereIndices;          ///< Total length of the sphere triangle lists
+    int voxels;                 ///< Number of voxels
+};
+
+/**
+ * Triangle as it is stored in a cache file. Plane and box are kept
+ * so that they don't have to be recalculated.
+ */
+struct CacheTriangle {
+    int v[3];
+    float A, B, C, D;
+    Box box;
+};
+
+/**
+ * 64-bit FNV-1a hash.
+ */
+static unsigned long long fnv1a(const void *data, size_t size, unsigned long long h=14695981039346656037ULL)
+{
+    const unsigned char *p = (const unsigned char*) data;
+    for (size_t i=0; i<size; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Copies n elements of type T from the cursor p into out and advances p.
+ */
+template <class T>
+static bool readArray(const char *&p, const char *end, vector<T> &out, size_t n)
+{
+    if ((size_t)(end-p) < n*sizeof(T)) return false;
+    out.resize(n);
+    if (n) memcpy(&out[0], p, n*sizeof(T));
+    p += n*sizeof(T);
+    return true;
+}
+
+template <class T>
+static void writeArray(FILE *file, const vector<T> &v)
+{
+    if (v.size()) fwrite(&v[0], sizeof(T), v.size(), file);
+}
+
+/**
+ * Checks that offsets and indices describe consecutive lists of triangles.
+ */
+static bool validLists(const vector<int> &offsets, const vector<int> &indices, int ntriangles)
+{
+    if (offsets[0] != 0 || offsets.back() != indices.size()) return false;
+    for (int i=0; i+1<offsets.size(); ++i)
+        if (offsets[i] > offsets[i+1]) return false;
+    for (int j=0; j<indices.size(); ++j)
+        if (indices[j] < 0 || indices[j] >= ntriangles) return false;
+    return true;
+}
+
+unsigned long long Mesh::cacheKey(string filename, bool ccw, const MeshOptions &opt)
+{
+    MappedFile file;
+    if (!file.open(filename)) return 0;
+    int params[] = {CACHE_VERSION, ccw, BVL, opt.volumeMode, opt.volumeDivs, opt.bvhBuilder, opt.leafSize, opt.maxDepth, opt.exactSplit};
+    return fnv1a(params, sizeof(params), fnv1a(file.data, file.size));
+}
+
+bool Mesh::readCache(string cachename, unsigned long long key)
+{
+    MappedFile file;
+    if (!key || !file.open(cachename)) return false;
+
+    const char *p = file.data, *end = file.data + file.size;
+    CacheHeader h;
+    if (file.size < sizeof(h)) return false;
+    memcpy(&h, p, sizeof(h));
+    p += sizeof(h);
+
+    if (memcmp(h.magic, CACHE_MAGIC, 4) || h.version != CACHE_VERSION || h.key != key ||
+        h.levels != BVL || h.sphereNodes != BVL_SIZE(BVL) || h.aabbNodes < 1 ||
+        h.vertices < 0 || h.triangles < 0)
+        return false;
+
+    vector<CacheTriangle> tris;
+    vector<float> aabbCover, sphereCov;
+
+    bool ok =
+        readArray(p, end, mVertices, h.vertices) &&
+        readArray(p, end, tris, h.triangles) &&
+        readArray(p, end, mVertexNormals, h.vertices) &&
+        readArray(p, end, mAABB, h.aabbNodes) &&
+        readArray(p, end, mAABBIndices, h.aabbIndices) &&
+        readArray(p, end, mSphere, h.sphereNodes) &&
+        readArray(p, end, mSphereOffsets, h.sphereNodes+1) &&
+        readArray(p, end, mSphereIndices, h.sphereIndices) &&
+        readArray(p, end, mVoxels, h.voxels) &&
+        readArray(p, end, aabbCover, BVL+1) &&
+        readArray(p, end, sphereCov, BVL+1);
+
+    ok = ok && validLists(mSphereOffsets, mSphereIndices, h.triangles);
+
+    ok = ok && (h.triangles == 0 || h.vertices > 0);
+
+    /* The two children of a node follow it and each other,
+     * and the triangles of a leaf lie inside the index array */
+    for (int bi=0; ok && bi<h.aabbNodes; ++bi) {
+        const BvhNode &node = mAABB[bi];
+        if (node.isLeaf())
+            ok = node.count >= 0 && node.index >= 0 && node.index+node.count <= h.aabbIndices;
+        else
+            ok = node.count == 0 && node.index > bi && node.index+1 < h.aabbNodes;
+    }
+    for (int i=0; ok && i<h.aabbIndices; ++i)
+        ok = mAABBIndices[i] >= 0 && mAABBIndices[i] < h.triangles;
+    if (ok && h.triangles) mTriangles.resize(h.triangles, Triangle(&mVertices, 0, 0, 0));
+    for (int i=0; ok && i<h.triangles; ++i) {
+        const CacheTriangle &c = tris[i];
+        Triangle &t = mTriangles[i];
+        for (int k=0; k<3; ++k) {
+            ok = ok && c.v[k] >= 0 && c.v[k] < h.vertices;
+            t.v[k] = c.v[k];
+        }
+        t.vecList = &mVertices;
+        t.A = c.A; t.B = c.B; t.C = c.C; t.D = c.D;
+        t.box = c.box;
+        t.deleted = false;
+    }
+
+    if (!ok) {
+        mVertices.clear();
+        mTriangles.clear();
+        mVertexNormals.clear();
+        mVoxels.clear();
+        mSphereOffsets.assign(BVL_SIZE(BVL)+1, 0);
+        mSphereIndices.clear();
+        return false;
+    }
+
+    std::copy(aabbCover.begin(), aabbCover.end(), AABBCover);
+    std::copy(sphereCov.begin(), sphereCov.end(), sphereCover);
+    return true;
+}
+
+void Mesh::writeCache(string cachename, unsigned long long key)
+{
+    if (!key) return;
+
+    CacheHeader h;
+    vector<CacheTriangle> tris(mTriangles.size());
+
+    for (int i=0; i<mTriangles.size(); ++i) {
+        const Triangle &t = mTriangles[i];
+        CacheTriangle &c = tris[i];
+        c.v[0] = t.vi1; c.v[1] = t.vi2; c.v[2] = t.vi3;
+        c.A = t.A; c.B = t.B; c.C = t.C; c.D = t.D;
+        c.box = t.box;
+    }
+
+    memcpy(h.magic, CACHE_MAGIC, 4);
+    h.version = CACHE_VERSION;
+    h.key = key;
+    h.levels = BVL;
+    h.vertices = mVertices.size();
+    h.triangles = mTriangles.size();
+    h.aabbNodes = mAABB.size();
+    h.sphereNodes = mSphere.size();
+    h.aabbIndices = mAABBIndices.size();
+    h.sphereIndices = mSphereIndices.size();
+    h.voxels = mVoxels.size();
+
+    /* Write to a temporary file and rename it,
+     * so that a reader never sees a half written cache */
+    string tmpname = cachename + ".tmp";
+    FILE *file = fopen(tmpname.c_str(), "wb");
+    if (!file) return;
+    fwrite(&h, sizeof(h), 1, file);
+    writeArray(file, mVertices);
+    writeArray(file, tris);
+    writeArray(file, mVertexNormals);
+    writeArray(file, mAABB);
+    writeArray(file, mAABBIndices);
+    writeArray(file, mSphere);
+    writeArray(file, mSphereOffsets);
+    writeArray(file, mSphereIndices);
+    writeArray(file, mVoxels);
+    fwrite(AABBCover, sizeof(float), BVL+1, file);
+    fwrite(sphereCover, sizeof(float), BVL+1, file);
+    bool ok = !ferror(file);
+    ok = !fclose(file) && ok;
+    if (!ok || rename(tmpname.c_str(), cachename.c_str()))
+        remove(tmpname.c_str());
+}
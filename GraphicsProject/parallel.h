@@ -0,0 +1,143 @@
+/** @file parallel.h
+ * Helpers for running work on several threads.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+class Parallel {
+
+    static int &threads() {
+        static int n = std::max(1u, thread::hardware_concurrency());
+        return n;
+    }
+
+    /** A range of indices owned by one thread of steal(). */
+    struct Block {
+        mutex lock;
+        int begin, end;
+    };
+
+    /** The loop of each thread of steal(). */
+    template <class Func>
+    static void stealWork(vector<Block> &blocks, int self, Func &func) {
+        Block &own = blocks[self];
+        int nt = blocks.size();
+        for (;;) {
+            int i = -1;
+            {
+                lock_guard<mutex> g(own.lock);
+                if (own.begin < own.end) i = own.begin++;
+            }
+            if (i >= 0) {
+                func(i);
+                continue;
+            }
+
+            /* Nothing left here. Take half of what a victim has left. */
+            bool stolen = false;
+            for (int v=1; v<nt && !stolen; ++v) {
+                Block &victim = blocks[(self+v)%nt];
+                int b, e;
+                {
+                    lock_guard<mutex> g(victim.lock);
+                    if (victim.begin >= victim.end) continue;
+                    b = victim.begin + (victim.end-victim.begin)/2;
+                    e = victim.end;
+                    victim.end = b;
+                }
+                lock_guard<mutex> g(own.lock);
+                own.begin = b;
+                own.end = e;
+                stolen = true;
+            }
+            if (!stolen) return;
+        }
+    }
+
+public:
+
+    /**
+     * Returns the number of threads used by the parallel algorithms.
+     */
+    static int threadCount() {
+        return threads();
+    }
+
+    /**
+     * Overrides the number of threads used by the parallel algorithms.
+     * @param [in] n The new thread count. Values below 1 mean 1.
+     */
+    static void setThreadCount(int n) {
+        threads() = std::max(1, n);
+    }
+
+    /**
+     * Calls func(i) for every i in [0,n), using up to threadCount() threads.
+     * The calling thread takes part in the work. Returns when all calls are done.
+     */
+    template <class Func>
+    static void run(int n, Func func) {
+        int nt = std::min(n, threadCount());
+        if (nt <= 1) {
+            for (int i=0; i<n; ++i) func(i);
+            return;
+        }
+
+        atomic<int> next(0);
+        vector<thread> workers;
+        for (int t=1; t<nt; ++t)
+            workers.push_back(thread([&]() { for (int i; (i=next++) < n; ) func(i); }));
+        for (int i; (i=next++) < n; ) func(i);
+        for (int t=0; t<workers.size(); ++t)
+            workers[t].join();
+    }
+
+    /**
+     * Calls func(i) for every i in [0,n), using up to threadCount() threads.
+     * Every thread starts with its own contiguous block of indices. A thread
+     * that runs out of work steals the upper half of the block of another
+     * thread, so neighbouring indices tend to run on the same thread.
+     * Returns when all calls are done.
+     */
+    template <class Func>
+    static void steal(int n, Func func) {
+        int nt = std::min(n, threadCount());
+        if (nt <= 1) {
+            for (int i=0; i<n; ++i) func(i);
+            return;
+        }
+
+        vector<Block> blocks(nt);
+        for (int t=0; t<nt; ++t) {
+            blocks[t].begin = (long long)n*t/nt;
+            blocks[t].end = (long long)n*(t+1)/nt;
+        }
+
+        vector<thread> workers;
+        for (int t=1; t<nt; ++t)
+            workers.push_back(thread([&, t]() { stealWork(blocks, t, func); }));
+        stealWork(blocks, 0, func);
+        for (int t=0; t<workers.size(); ++t)
+            workers[t].join();
+    }
+
+    /**
+     * Returns a monotonic wall clock time in seconds.
+     * Use this instead of clock() when timing multi-threaded code.
+     */
+    static double seconds() {
+        return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+#endif